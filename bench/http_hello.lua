@@ -0,0 +1,39 @@
+-- HTTP dispatch microbenchmark.
+--
+-- Measures requests/sec through the full C++ -> middleware -> Lua handler path,
+-- which is where per-request overhead such as locking shows up.
+--
+--   luajit bench/http_hello.lua [port] [workers]
+--   wrk -t4 -c256 -d30s http://127.0.0.1:8080/hello
+--
+-- Build the commit before and after a change, run both with the same wrk
+-- command and compare the Requests/sec lines. With workers > 1 the server is
+-- started through create_cluster() instead of a single app.
+
+package.cpath = "./src/?.so;" .. package.cpath
+
+local uws = require("uwebsockets")
+
+local port = tonumber(arg and arg[1]) or 8080
+local workers = tonumber(arg and arg[2]) or 1
+
+local bootstrap = string.format([[
+local uws = require("uwebsockets")
+local app = uws.create_app()
+
+app.use(function(req, res) return true end)
+
+app.get("/hello", function(req, res)
+    res:writeHeader("Content-Type", "text/plain")
+    res:send("Hello, World!")
+end)
+
+app.listen(%d)
+app.run()
+]], port)
+
+if workers > 1 then
+    uws.create_cluster(workers, bootstrap)
+else
+    assert(loadstring(bootstrap))()
+end
@@ -0,0 +1,53 @@
+-- SSE broadcast benchmark.
+--
+-- Every client that connects to /events joins the "ticks" channel. A timer
+-- publishes one event to the channel every interval and prints how long each
+-- publish took and how many subscribers it reached.
+--
+--   luajit bench/sse_broadcast.lua [port] [interval_ms] [mode]   -- mode: channel | loop
+--   for i in $(seq 1000); do curl -sN http://127.0.0.1:8080/events >/dev/null & done
+--
+-- "channel" uses app.sse_publish, which serializes the event once and writes it
+-- to every subscriber from C++. "loop" calls app.sse_send for each connection
+-- from Lua, which is how a broadcast had to be written before channels existed.
+
+package.cpath = "./src/?.so;" .. package.cpath
+
+local uws = require("uwebsockets")
+
+local port = tonumber(arg and arg[1]) or 8080
+local interval = tonumber(arg and arg[2]) or 1000
+local mode = (arg and arg[3]) or "channel"
+
+local app = uws.create_app()
+
+local clients = {}
+
+app.sse("/events", function(req, sse_id)
+    clients[#clients + 1] = sse_id
+end, { channels = { "ticks" } })
+
+local payload = string.rep("x", 256)
+local seq = 0
+
+app.setInterval(function()
+    seq = seq + 1
+    local start = os.clock()
+    local reached
+    if mode == "loop" then
+        reached = 0
+        for i = 1, #clients do
+            if app.sse_send(clients[i], payload, "tick", tostring(seq)) then
+                reached = reached + 1
+            end
+        end
+    else
+        reached = app.sse_publish("ticks", payload, "tick", tostring(seq))
+    end
+    print(string.format("publish #%d (%s): %d subscribers, %.3f ms CPU",
+        seq, mode, reached, (os.clock() - start) * 1000))
+end, interval)
+
+print(string.format("SSE broadcast benchmark (%s) on http://127.0.0.1:%d/events", mode, port))
+app.listen(port)
+app.run()
@@ -0,0 +1,58 @@
+-- Static file transfer benchmark: sendfile vs. the copying paths.
+--
+-- Compares throughput and server CPU per GB for large files served by
+-- serve_static with sendfile on and off. With sendfile off, files up to 10MB
+-- go through the ifstream path and larger ones through the mmap path.
+--
+--   luajit bench/static_sendfile.lua [port] [mode]      -- mode: sendfile | copy
+--   curl -s http://127.0.0.1:8080/cpu                   -- before
+--   wrk -t4 -c64 -d30s http://127.0.0.1:8080/files/medium.bin   -- ifstream path when mode=copy
+--   wrk -t4 -c64 -d30s http://127.0.0.1:8080/files/large.bin    -- mmap path when mode=copy
+--   curl -s http://127.0.0.1:8080/cpu                   -- after
+--
+-- /cpu returns the process CPU seconds used so far. CPU per GB is
+-- (cpu_after - cpu_before) / (wrk "Transfer/sec" * duration in GB).
+-- Run each file once per mode and compare Transfer/sec and CPU per GB.
+-- The files are created in bench/files on the first run.
+
+package.cpath = "./src/?.so;" .. package.cpath
+
+local uws = require("uwebsockets")
+
+local port = tonumber(arg and arg[1]) or 8080
+local mode = (arg and arg[2]) or "sendfile"
+local dir = "bench/files"
+
+local function ensure_file(name, size)
+    local path = dir .. "/" .. name
+    local f = io.open(path, "rb")
+    if f then
+        local current = f:seek("end")
+        f:close()
+        if current == size then return end
+    end
+    f = assert(io.open(path, "wb"))
+    local block = string.rep("0123456789abcdef", 4096) -- 64KB
+    for _ = 1, size / #block do
+        f:write(block)
+    end
+    f:close()
+end
+
+os.execute("mkdir -p " .. dir)
+ensure_file("medium.bin", 8 * 1024 * 1024)
+ensure_file("large.bin", 256 * 1024 * 1024)
+
+local app = uws.create_app()
+
+-- No in-memory cache so every request goes through the transfer path under test
+app.serve_static("/files", dir, { cache = false, sendfile = mode == "sendfile" })
+
+app.get("/cpu", function(req, res)
+    res:writeHeader("Content-Type", "text/plain")
+    res:send(string.format("%.3f", os.clock()))
+end)
+
+print(string.format("serving %s on port %d (mode=%s)", dir, port, mode))
+app.listen(port)
+app.run()
@@ -0,0 +1,65 @@
+-- WebSocket message dispatch benchmark.
+--
+-- Measures messages/sec through the C++ -> Lua .message path and how much the
+-- Lua heap grows per message, which is what the garbage collector has to clean up.
+--
+--   luajit bench/ws_messages.lua [port] [batch]
+--   tcpkali --websocket -c 100 -m 'hello' -r 2000 -T 30s 127.0.0.1:8080/ws
+--
+-- The server prints one line per second with messages/sec and the Lua heap size.
+-- Every 10th second the collector is stopped for one second, and that line also
+-- shows the bytes allocated per message. Run this before and after a change with
+-- the same tcpkali command and compare msgs/sec and bytes/msg.
+--
+-- Pass "connection" or "route" as the second argument to receive messages batched per
+-- loop iteration instead of one Lua call per frame.
+
+package.cpath = "./src/?.so;" .. package.cpath
+
+local uws = require("uwebsockets")
+
+local port = tonumber(arg and arg[1]) or 8080
+local batch = arg and arg[2]
+
+local app = uws.create_app()
+
+local messages = 0
+
+app.ws("/ws", function(ws, event, message)
+    if event == "message" then
+        messages = messages + 1
+    elseif event == "messages" then
+        messages = messages + #message
+    end
+end, { batch = batch })
+
+local tick = 0
+local last_messages = 0
+local probe_start_kb = nil
+
+app.setInterval(function()
+    tick = tick + 1
+    local delta = messages - last_messages
+    last_messages = messages
+    local heap_kb = collectgarbage("count")
+
+    if probe_start_kb then
+        local bytes = (heap_kb - probe_start_kb) * 1024
+        print(string.format("%8d msgs/sec  heap %9.1f KB  %6.1f bytes/msg (GC stopped)",
+            delta, heap_kb, delta > 0 and bytes / delta or 0))
+        probe_start_kb = nil
+        collectgarbage("restart")
+    else
+        print(string.format("%8d msgs/sec  heap %9.1f KB", delta, heap_kb))
+    end
+
+    if tick % 10 == 0 then
+        collectgarbage("collect")
+        collectgarbage("stop")
+        probe_start_kb = collectgarbage("count")
+    end
+end, 1000)
+
+print(string.format("WebSocket benchmark on ws://127.0.0.1:%d/ws (batch: %s)", port, batch or "off"))
+app.listen(port)
+app.run()
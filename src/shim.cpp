@@ -2,11 +2,16 @@
 #include <lua.hpp>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <string_view>
 #include <vector>
 #include <functional>
+#include <thread>
 #include <string> // For std::to_string
 #include <sys/socket.h> // For sockaddr, sockaddr_storage
 #include <netdb.h>
@@ -17,13 +22,28 @@
 #include <filesystem> // For path manipulation (C++17)
 
 #include <chrono>
+#include <ctime>
+#include <list>
+#include <algorithm>
 #include <sys/stat.h> // Added for fstat
+#include <zlib.h>
 
 #include <system_error>
+#include <cerrno>
+#include <cstring>
 #ifdef __linux__
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <unistd.h>
+// The io_uring backend wakes the loop through a private uSockets primitive, so it is
+// only built against the epoll backend and when CMake has found the expected
+// us_internal_create_async signature in the vendored uSockets (UWS_LUA_USOCKETS_ASYNC_ABI)
+#if __has_include(<linux/io_uring.h>) && defined(LIBUS_USE_EPOLL) && defined(UWS_LUA_USOCKETS_ASYNC_ABI)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define UWS_LUA_HAVE_IO_URING 1
+#endif
 #elif _WIN32
 #include <windows.h>
 #endif
@@ -35,26 +55,43 @@ namespace fs = std::filesystem; // Alias for convenience
 
 // For getnameinfo, NI_MAXHOST, NI_NUMERICHOST
 
-static std::shared_ptr<uWS::App> app;
-static us_listen_socket_t *listen_socket = nullptr;
-static lua_State *main_L = nullptr;
-static std::mutex lua_mutex;
-static std::unordered_map<int, int> lua_callbacks; // For general route callbacks
-static int callback_id_counter = 0;
+// Every piece of per-server state below is thread_local: a process normally has a
+// single loop thread, but create_cluster() runs one uWS::App + lua_State + loop
+// per worker thread and each of them must see only its own copy.
+static thread_local std::shared_ptr<uWS::App> app;
+static thread_local us_listen_socket_t *listen_socket = nullptr;
+static thread_local lua_State *main_L = nullptr;
+static thread_local std::unordered_map<int, int> lua_callbacks; // For general route callbacks
+static thread_local int callback_id_counter = 0;
 
 // --- SSE Specific Global State ---
 // Map to store active SSE connections, identified by a unique ID
 // Maps a generated SSE_ID to a shared_ptr to the HttpResponse object and the associated Lua callback ref
+struct SseChannel;
+
 struct SseConnection {
     uWS::HttpResponse<false>* res; // Raw pointer, managed by uWS lifecycle
     int lua_ref; // Lua reference to the callback to send data
     bool is_aborted; // Flag to track if connection has been aborted
+    std::string id;
+    std::vector<std::pair<SseChannel*, size_t>> channels; // Subscriptions and our slot in each
 };
-// Use a map to store active SSE connections for easy lookup and management
-static std::unordered_map<std::string, std::shared_ptr<SseConnection>> active_sse_connections;
-static std::mutex sse_connections_mutex; // Mutex for active_sse_connections map
 
-// Function to generate a simple unique ID (re-using from original file)
+// Named broadcast group of SSE connections. Subscribers sit in a dense vector so a
+// publish is one pass over it; each connection remembers its slot for O(1) removal.
+struct SseChannel {
+    std::string name;
+    std::vector<std::shared_ptr<SseConnection>> subscribers;
+};
+// Use a map to store active SSE connections for easy lookup and management
+static thread_local std::unordered_map<std::string, std::shared_ptr<SseConnection>> active_sse_connections;
+static thread_local std::mutex sse_connections_mutex; // Mutex for active_sse_connections map
+
+// Connection ids for WebSockets and SSE: a 64-bit value, unique per thread, and its
+// "xxxx-xx-xx-xx-xxxxxx" text form. Maps can key on the integer form.
+uint64_t generate_unique_id_value();
+std::string format_unique_id(uint64_t value);
+bool parse_unique_id(std::string_view text, uint64_t &value);
 std::string generate_unique_id(); // Forward declaration for use in uw_sse
 
 struct DummyUserData {};
@@ -63,13 +100,24 @@ struct DummyUserData {};
 struct Middleware {
     int ref; // Lua function reference
     bool global; // true for global, false for route-specific
-    std::string route; // Route for route-specific middleware
+    std::string route; // Route for route-specific middleware; the prefix without "*" when prefix is set
+    bool prefix = false; // Registered as "/api/*": applies to every route under /api
+};
+
+static thread_local std::vector<Middleware> middlewares;
+
+// Middleware refs applying to one registered route, in registration order. Chains are
+// compiled when the route is registered and extended by later app.use calls, so a request
+// only walks the middlewares that apply to it. Handlers capture the chain's index.
+struct MiddlewareChain {
+    std::string route;
+    std::vector<int> refs;
 };
 
-static std::vector<Middleware> middlewares;
+static thread_local std::vector<MiddlewareChain> middleware_chains;
 
-int timer_id = 0;
-us_loop_t *main_loop = nullptr;
+thread_local int timer_id = 0;
+thread_local us_loop_t *main_loop = nullptr;
 
 struct LuaTimerData {
     lua_State* owner;
@@ -97,6 +145,95 @@ uWS::Loop *get_uWS_Loop() {
     return uWS::Loop::get();
 }
 
+// --- Loop-affine completion queue ---
+// Lua must only be entered from the loop thread that owns main_L. Background threads
+// never lock or touch the Lua state; they post a completion here instead. Posting is a
+// lock-free push onto an intrusive MPSC stack, and only the push that finds no drain
+// pending pays for a Loop::defer wakeup. The loop then runs the whole batch in FIFO order.
+class CompletionQueue : public std::enable_shared_from_this<CompletionQueue> {
+public:
+    using Completion = uWS::MoveOnlyFunction<void(lua_State*)>;
+
+    explicit CompletionQueue(uWS::Loop *loop) : loop(loop) {}
+
+    ~CompletionQueue() {
+        Node *node = head.exchange(nullptr, std::memory_order_acquire);
+        while (node) {
+            Node *next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    // Safe to call from any thread
+    void post(Completion &&fn) {
+        Node *node = new Node{nullptr, std::move(fn)};
+        Node *old_head = head.load(std::memory_order_relaxed);
+        do {
+            node->next = old_head;
+        } while (!head.compare_exchange_weak(old_head, node, std::memory_order_release, std::memory_order_relaxed));
+
+        if (!drain_scheduled.exchange(true, std::memory_order_acq_rel)) {
+            loop->defer([self = shared_from_this()]() {
+                self->drain();
+            });
+        }
+    }
+
+    // Runs on the loop thread
+    void drain() {
+        // Clear the flag before taking the batch so a post racing with us schedules a new drain
+        drain_scheduled.store(false, std::memory_order_release);
+        Node *batch = head.exchange(nullptr, std::memory_order_acquire);
+
+        // The stack hands nodes back newest-first; reverse to preserve posting order
+        Node *fifo = nullptr;
+        while (batch) {
+            Node *next = batch->next;
+            batch->next = fifo;
+            fifo = batch;
+            batch = next;
+        }
+
+        while (fifo) {
+            Node *next = fifo->next;
+            fifo->fn(main_L);
+            delete fifo;
+            fifo = next;
+        }
+    }
+
+private:
+    struct Node {
+        Node *next;
+        Completion fn;
+    };
+
+    uWS::Loop *loop;
+    std::atomic<Node*> head{nullptr};
+    std::atomic<bool> drain_scheduled{false};
+};
+
+static thread_local std::shared_ptr<CompletionQueue> completion_queue;
+
+// Returns the completion queue of the calling loop thread, creating it on first use.
+// Background jobs keep the shared_ptr so the queue outlives any in-flight work.
+static std::shared_ptr<CompletionQueue> get_completion_queue() {
+    if (!completion_queue) {
+        completion_queue = std::make_shared<CompletionQueue>(uWS::Loop::get());
+    }
+    return completion_queue;
+}
+
+// Completion callbacks for whole-file operations; always invoked on the loop thread
+using FileReadDone = uWS::MoveOnlyFunction<void(std::string& content, const std::string& error)>;
+using FileWriteDone = uWS::MoveOnlyFunction<void(bool success, const std::string& error)>;
+
+// Starts an io_uring read on this loop; false when the ring is unavailable or busy
+// (defined with the file operations below)
+static bool submit_ring_read(const std::string& path, FileReadDone& done);
+static std::string read_whole_file(const std::string& path, std::string& error_message);
+
 
 // Helper to push Lua table from C++ map
 void push_map_to_lua(lua_State* L, const std::unordered_map<std::string, std::string>& m) {
@@ -113,10 +250,73 @@ void push_map_to_lua(lua_State* L, const std::unordered_map<std::string, std::st
 
 
 
+// App methods such as uw_get read their arguments from index 1, i.e. app.get(route, fn).
+// Newer methods also accept method-call syntax (app:publish(...)); this returns the
+// index of their first real argument by skipping a leading uWS.App userdata.
+static int first_arg_index(lua_State *L) {
+    if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+        luaL_getmetatable(L, "uWS.App");
+        bool is_app = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (is_app) return 2;
+    }
+    return 1;
+}
+
+// Owned copy of a request's method, url, query and headers. uWS::HttpRequest is only
+// valid during the route handler; a snapshot is not, so handlers that run later (body
+// callbacks) take one eagerly and req:headers() builds one lazily on first use.
+struct RequestSnapshot {
+    std::string method;
+    std::string url;
+    std::string query;
+    std::vector<std::pair<std::string, std::string>> headers; // Names lower-cased by uWS
+
+    explicit RequestSnapshot(uWS::HttpRequest &req)
+        : method(req.getMethod()), url(req.getUrl()), query(req.getQuery()) {
+        for (auto header : req) {
+            headers.emplace_back(header.first, header.second);
+        }
+    }
+
+    std::string_view header(std::string_view name) const {
+        for (const auto& header : headers) {
+            if (header.first == name) return header.second;
+        }
+        return {};
+    }
+};
+
+// The req userdata. req comes first so code casting the userdata to HttpRequest** keeps
+// working; it is null for requests backed only by a snapshot. The snapshot itself is a
+// separate userdata with a __gc, anchored in the req's environment table, so requests
+// that never take one pay no finalizer.
+struct RequestUserData {
+    uWS::HttpRequest *req;
+    RequestSnapshot *snapshot;
+};
+
+static RequestSnapshot* push_request_snapshot(lua_State *L, std::shared_ptr<RequestSnapshot> snapshot) {
+    void *ud = lua_newuserdata(L, sizeof(std::shared_ptr<RequestSnapshot>));
+    auto *holder = new (ud) std::shared_ptr<RequestSnapshot>(std::move(snapshot));
+    luaL_getmetatable(L, "req.snapshot");
+    lua_setmetatable(L, -2);
+    return holder->get();
+}
+
+// Attaches a snapshot to the req userdata at index, keeping it alive through its environment
+static void attach_request_snapshot(lua_State *L, int index, std::shared_ptr<RequestSnapshot> snapshot) {
+    RequestUserData *data = static_cast<RequestUserData*>(lua_touserdata(L, index));
+    lua_createtable(L, 1, 0);
+    data->snapshot = push_request_snapshot(L, std::move(snapshot));
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, index < 0 ? index - 1 : index);
+}
+
 int create_req_userdata(lua_State *L, uWS::HttpRequest* req) {
-    void *ud = lua_newuserdata(L, sizeof(uWS::HttpRequest*));
-    uWS::HttpRequest** req_ptr = (uWS::HttpRequest**)ud;
-    *req_ptr = req;
+    RequestUserData *data = static_cast<RequestUserData*>(lua_newuserdata(L, sizeof(RequestUserData)));
+    data->req = req;
+    data->snapshot = nullptr;
 
     luaL_getmetatable(L, "req");
     lua_setmetatable(L, -2);
@@ -124,6 +324,19 @@ int create_req_userdata(lua_State *L, uWS::HttpRequest* req) {
     return 1;
 }
 
+int create_req_userdata(lua_State *L, const std::shared_ptr<RequestSnapshot>& snapshot) {
+    create_req_userdata(L, static_cast<uWS::HttpRequest*>(nullptr));
+    attach_request_snapshot(L, -1, snapshot);
+    return 1;
+}
+
+// The response behind a res userdata; raises once it has been detached from a finished request
+static uWS::HttpResponse<false>** check_res(lua_State *L) {
+    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    if (!*res) luaL_error(L, "response has already been sent");
+    return res;
+}
+
 int create_res_userdata(lua_State *L, uWS::HttpResponse<false>* res) {
     void *ud = lua_newuserdata(L, sizeof(uWS::HttpResponse<false>*));
     uWS::HttpResponse<false>** res_ptr = (uWS::HttpResponse<false>**)ud;
@@ -145,23 +358,128 @@ int create_sse_res_userdata(lua_State *L, uWS::HttpResponse<false>* res, const s
 }
 
 
+// Status lines for codes 100-599, built once: "404 Not Found" for registered codes
+// and the bare number for the rest
+static std::string_view http_status_line(int status) {
+    static const std::vector<std::string> lines = [] {
+        static const std::pair<int, const char*> reasons[] = {
+            {100, "Continue"}, {101, "Switching Protocols"}, {103, "Early Hints"},
+            {200, "OK"}, {201, "Created"}, {202, "Accepted"}, {203, "Non-Authoritative Information"},
+            {204, "No Content"}, {205, "Reset Content"}, {206, "Partial Content"},
+            {300, "Multiple Choices"}, {301, "Moved Permanently"}, {302, "Found"}, {303, "See Other"},
+            {304, "Not Modified"}, {307, "Temporary Redirect"}, {308, "Permanent Redirect"},
+            {400, "Bad Request"}, {401, "Unauthorized"}, {402, "Payment Required"}, {403, "Forbidden"},
+            {404, "Not Found"}, {405, "Method Not Allowed"}, {406, "Not Acceptable"},
+            {408, "Request Timeout"}, {409, "Conflict"}, {410, "Gone"}, {411, "Length Required"},
+            {412, "Precondition Failed"}, {413, "Content Too Large"}, {414, "URI Too Long"},
+            {415, "Unsupported Media Type"}, {416, "Range Not Satisfiable"}, {417, "Expectation Failed"},
+            {422, "Unprocessable Content"}, {425, "Too Early"}, {426, "Upgrade Required"},
+            {428, "Precondition Required"}, {429, "Too Many Requests"},
+            {431, "Request Header Fields Too Large"}, {451, "Unavailable For Legal Reasons"},
+            {500, "Internal Server Error"}, {501, "Not Implemented"}, {502, "Bad Gateway"},
+            {503, "Service Unavailable"}, {504, "Gateway Timeout"}, {505, "HTTP Version Not Supported"},
+        };
+        std::vector<std::string> table(600);
+        for (int code = 100; code < 600; code++) table[code] = std::to_string(code);
+        for (const auto& reason : reasons) table[reason.first] += std::string(" ") + reason.second;
+        return table;
+    }();
+    if (status < 100 || status >= 600) return {};
+    return lines[status];
+}
+
+// Lua Usage: res:writeStatus(404) or res:status(404) -> res
 static int res_writeStatus(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    uWS::HttpResponse<false>** res = check_res(L);
     int status = luaL_checkinteger(L, 2);
-    (*res)->writeStatus(std::to_string(status).c_str());
+    std::string_view line = http_status_line(status);
+    if (line.empty()) luaL_argerror(L, 2, "status must be between 100 and 599");
+    (*res)->writeStatus(line);
     lua_pushvalue(L, 1); // Return self for chaining
     return 1;
 }
 
+// Lua Usage: res:send(body)
+static int res_send(lua_State *L) {
+    uWS::HttpResponse<false>** res = check_res(L);
+    size_t len;
+    const char *response = luaL_checklstring(L, 2, &len);
+    (*res)->end(std::string_view(response, len));
+    return 0;
+}
+
+// Lua Usage: res:writeHeader(name, value) -> res
+static int res_writeHeader(lua_State *L) {
+    uWS::HttpResponse<false>** res = check_res(L);
+    size_t header_len, value_len;
+    const char *header = luaL_checklstring(L, 2, &header_len);
+    const char *value = luaL_checklstring(L, 3, &value_len);
+    (*res)->writeHeader(std::string_view(header, header_len), std::string_view(value, value_len));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+// Lua Usage: res:writeHeaders({ ["Content-Type"] = "text/html", ["X-Id"] = 7 }) -> res
+// Numbers are written as-is; a table value writes the header once per element.
+static int res_writeHeaders(lua_State *L) {
+    uWS::HttpResponse<false>** res = check_res(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            luaL_error(L, "writeHeaders: header names must be strings");
+        }
+        size_t header_len, value_len;
+        const char *header = lua_tolstring(L, -2, &header_len);
+        if (lua_istable(L, -1)) {
+            int count = static_cast<int>(lua_objlen(L, -1));
+            for (int i = 1; i <= count; i++) {
+                lua_rawgeti(L, -1, i);
+                const char *value = luaL_checklstring(L, -1, &value_len);
+                (*res)->writeHeader(std::string_view(header, header_len), std::string_view(value, value_len));
+                lua_pop(L, 1);
+            }
+        } else if (lua_type(L, -1) == LUA_TNUMBER) {
+            // lua_tolstring would turn the value into a string in place and confuse lua_next
+            lua_pushvalue(L, -1);
+            const char *value = lua_tolstring(L, -1, &value_len);
+            (*res)->writeHeader(std::string_view(header, header_len), std::string_view(value, value_len));
+            lua_pop(L, 1);
+        } else {
+            const char *value = luaL_checklstring(L, -1, &value_len);
+            (*res)->writeHeader(std::string_view(header, header_len), std::string_view(value, value_len));
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+// Lua Usage: res:json(body [, status])
+// Ends the response with an already encoded JSON body and its Content-Type.
+static int res_json(lua_State *L) {
+    uWS::HttpResponse<false>** res = check_res(L);
+    size_t len;
+    const char *body = luaL_checklstring(L, 2, &len);
+    if (!lua_isnoneornil(L, 3)) {
+        std::string_view line = http_status_line(static_cast<int>(luaL_checkinteger(L, 3)));
+        if (line.empty()) luaL_argerror(L, 3, "status must be between 100 and 599");
+        (*res)->writeStatus(line);
+    }
+    (*res)->writeHeader("Content-Type", "application/json");
+    (*res)->end(std::string_view(body, len));
+    return 0;
+}
+
 static int res_getRemoteAddress(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    uWS::HttpResponse<false>** res = check_res(L);
     std::string_view remoteAddress = (*res)->getRemoteAddress();
     lua_pushlstring(L, remoteAddress.data(), remoteAddress.length());
     return 1;
 }
 
 static int res_getProxiedRemoteAddress(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    uWS::HttpResponse<false>** res = check_res(L);
     // In newer uWebSockets versions, you might need to check headers like X-Forwarded-For
     // For simplicity, let's just return the regular remote address for now.
     return res_getRemoteAddress(L);
@@ -169,14 +487,15 @@ static int res_getProxiedRemoteAddress(lua_State *L) {
 
 
 static int res_closeConnection(lua_State *L) {
-    uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
+    uWS::HttpResponse<false>** res = check_res(L);
     (*res)->close();
     return 0;
 }
 
+static int res_stream(lua_State *L);
+
 // Function to call a Lua callback with optional arguments
 void call_lua_callback(int lua_ref, int num_args, std::function<void(lua_State*)> push_args) {
-    std::lock_guard<std::mutex> lock(lua_mutex);
     lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_ref);
     if (lua_isfunction(main_L, -1)) {
         push_args(main_L);
@@ -193,30 +512,134 @@ void call_lua_callback(int lua_ref, int num_args, std::function<void(lua_State*)
 // User data structure for WebSocket
 struct WebSocketUserData {
     std::string id;
+    uint64_t id_value = 0; // Integer form of id
     bool is_closed = false;
     uWS::WebSocket<false, true, WebSocketUserData>* socket = nullptr;
+    bool compress = false; // Route negotiated permessage-deflate; sends compress by default
+    int lua_ref = LUA_NOREF; // The connection's Lua userdata, created in .open and reused for every event
+    lua_Integer handle = 0; // Registry handle, 0 once the connection has left the registry
      // Store additional user data if needed
     std::unordered_map<std::string, std::string> metadata;
 };
 
-// Fully corrected create_zombie_websocket
-static int create_zombie_websocket(lua_State *L, const std::string& id) {
+// One Lua userdata per connection: created in .open, kept alive by a registry ref in
+// WebSocketUserData and pushed again for every event, so frames allocate nothing on the
+// Lua side. Its environment table holds the id so it stays readable after close, when
+// the socket pointer inside is cleared.
+static void create_websocket_userdata(lua_State *L, uWS::WebSocket<false, true, WebSocketUserData> *ws) {
+    WebSocketUserData *data = ws->getUserData();
+
     using WebSocketPtr = uWS::WebSocket<false, true, WebSocketUserData>*;
-    
-    WebSocketPtr* ws_ud = static_cast<WebSocketPtr*>(
-        lua_newuserdata(L, sizeof(WebSocketPtr)));
-    *ws_ud = nullptr;
-    
-    lua_newtable(L);
-    lua_pushstring(L, id.c_str());
-    lua_setfield(L, -2, "id");
-    lua_pushboolean(L, true);
-    lua_setfield(L, -2, "closed");
-    
+    WebSocketPtr *ws_ud = static_cast<WebSocketPtr*>(lua_newuserdata(L, sizeof(WebSocketPtr)));
+    *ws_ud = ws;
     luaL_getmetatable(L, "websocket");
     lua_setmetatable(L, -2);
-    
-    return 1;
+
+    lua_createtable(L, 0, 1);
+    lua_pushlstring(L, data->id.data(), data->id.size());
+    lua_setfield(L, -2, "id");
+    lua_setfenv(L, -2);
+
+    lua_pushvalue(L, -1);
+    data->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void push_websocket_userdata(lua_State *L, uWS::WebSocket<false, true, WebSocketUserData> *ws) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ws->getUserData()->lua_ref);
+}
+
+// Id of a websocket userdata, also after the connection has closed; pushes nil if unknown
+static void push_websocket_id(lua_State *L, int index) {
+    lua_getfenv(L, index);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "id");
+        lua_remove(L, -2);
+    } else {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+}
+
+// Live connections of this thread's app, addressable by string id or integer handle so
+// timers and other routes can reach a socket without keeping its userdata around.
+// A handle packs a dense slot index with the slot's generation, which is bumped on every
+// release, so a handle kept past its connection's close never resolves to a newer one.
+struct WebSocketRegistry {
+    using Socket = uWS::WebSocket<false, true, WebSocketUserData>;
+
+    std::vector<Socket*> slots;
+    std::vector<uint32_t> generations;
+    std::vector<uint32_t> free_slots;
+    std::unordered_map<uint64_t, uint32_t> by_id;
+    size_t count = 0;
+
+    static lua_Integer make_handle(uint32_t slot, uint32_t generation) {
+        return (static_cast<lua_Integer>(generation) << 24) | (slot + 1);
+    }
+
+    void add(Socket *ws) {
+        WebSocketUserData *data = ws->getUserData();
+        uint32_t slot;
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+            slots[slot] = ws;
+        } else {
+            slot = static_cast<uint32_t>(slots.size());
+            slots.push_back(ws);
+            generations.push_back(0);
+        }
+        data->handle = make_handle(slot, generations[slot]);
+        by_id[data->id_value] = slot;
+        count++;
+    }
+
+    void remove(Socket *ws) {
+        WebSocketUserData *data = ws->getUserData();
+        if (!data->handle) return;
+        uint32_t slot = static_cast<uint32_t>((data->handle & 0xFFFFFF) - 1);
+        slots[slot] = nullptr;
+        generations[slot] = (generations[slot] + 1) & 0xFFFFFFF;
+        free_slots.push_back(slot);
+        by_id.erase(data->id_value);
+        data->handle = 0;
+        count--;
+    }
+
+    Socket* find(lua_Integer handle) const {
+        if (handle <= 0) return nullptr;
+        lua_Integer slot = (handle & 0xFFFFFF) - 1;
+        if (slot < 0 || static_cast<size_t>(slot) >= slots.size()) return nullptr;
+        if (make_handle(static_cast<uint32_t>(slot), generations[slot]) != handle) return nullptr;
+        return slots[slot];
+    }
+
+    Socket* find(std::string_view id) const {
+        uint64_t value;
+        if (!parse_unique_id(id, value)) return nullptr;
+        auto it = by_id.find(value);
+        return it == by_id.end() ? nullptr : slots[it->second];
+    }
+
+    void clear() {
+        slots.clear();
+        generations.clear();
+        free_slots.clear();
+        by_id.clear();
+        count = 0;
+    }
+};
+
+static thread_local WebSocketRegistry websocket_registry;
+
+// Resolves an id string or integer handle argument to a live socket, or nullptr
+static WebSocketRegistry::Socket* check_registered_websocket(lua_State *L, int index) {
+    if (lua_type(L, index) == LUA_TNUMBER) {
+        return websocket_registry.find(lua_tointeger(L, index));
+    }
+    size_t len;
+    const char *id = luaL_checklstring(L, index, &len);
+    return websocket_registry.find(std::string_view(id, len));
 }
 
 
@@ -258,8 +681,24 @@ static int create_zombie_websocket(lua_State *L, const std::string& id) {
 //     return 1;
 // }
 
+// Pushes ok, status, buffered_amount for a send. "backpressure" means the frame was
+// queued and the socket is falling behind (a "drain" event follows); "dropped" means it
+// was discarded because maxBackpressure was exceeded.
+static void push_send_status(lua_State *L, uWS::WebSocket<false, true, WebSocketUserData>::SendStatus status,
+                             unsigned int buffered_amount) {
+    using WebSocket = uWS::WebSocket<false, true, WebSocketUserData>;
+    lua_pushboolean(L, status != WebSocket::DROPPED);
+    switch (status) {
+        case WebSocket::SUCCESS: lua_pushliteral(L, "success"); break;
+        case WebSocket::BACKPRESSURE: lua_pushliteral(L, "backpressure"); break;
+        default: lua_pushliteral(L, "dropped"); break;
+    }
+    lua_pushinteger(L, buffered_amount);
+}
+
 // Update websocket_send to handle zombie sockets
 // Fully corrected websocket_send
+// Lua Usage: local ok, status, buffered = ws:send(message [, "binary"])
 static int websocket_send(lua_State *L) {
     using WebSocketPtr = uWS::WebSocket<false, true, WebSocketUserData>*;
     
@@ -271,17 +710,15 @@ static int websocket_send(lua_State *L) {
     }
 
     if (!*ws_ptr) {
-        if (lua_getmetatable(L, 1)) {
-            lua_getfield(L, -1, "id");
-            if (lua_isstring(L, -1)) {
-                const char* id = lua_tostring(L, -1);
-                lua_pushboolean(L, 0);
-                lua_pushfstring(L, "Socket %s is closed", id);
-                lua_remove(L, -3);
-                return 2;
-            }
-            lua_pop(L, 2);
+        push_websocket_id(L, 1);
+        if (lua_isstring(L, -1)) {
+            const char* id = lua_tostring(L, -1);
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "Socket %s is closed", id);
+            lua_remove(L, -3);
+            return 2;
         }
+        lua_pop(L, 1);
         lua_pushboolean(L, 0);
         lua_pushstring(L, "Socket is closed");
         return 2;
@@ -305,8 +742,20 @@ static int websocket_send(lua_State *L) {
         }
     }
 
-    userdata->socket->send(std::string_view(message, len), opcode);
-    lua_pushboolean(L, 1);
+    auto status = userdata->socket->send(std::string_view(message, len), opcode, userdata->compress);
+    push_send_status(L, status, userdata->socket->getBufferedAmount());
+    return 3;
+}
+
+// Lua Usage: ws:get_buffered_amount() -> bytes queued in user space for this socket
+static int websocket_get_buffered_amount(lua_State *L) {
+    auto **ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(luaL_checkudata(L, 1, "websocket"));
+    WebSocketUserData *userdata = *ws_ud ? (*ws_ud)->getUserData() : nullptr;
+    if (!userdata || userdata->is_closed || userdata->socket != *ws_ud) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    lua_pushinteger(L, (*ws_ud)->getBufferedAmount());
     return 1;
 }
 
@@ -350,15 +799,8 @@ static int websocket_get_id(lua_State *L) {
     
     // Handle zombie sockets
     if (!*ws_ud) {
-        if (lua_getmetatable(L, 1)) {
-            lua_getfield(L, -1, "id");
-            if (lua_isstring(L, -1)) {
-                // Return the ID from the environment table
-                return 1;
-            }
-            lua_pop(L, 2); // pop string and metatable
-        }
-        lua_pushnil(L);
+        // Return the ID from the environment table
+        push_websocket_id(L, 1);
         return 1;
     }
 
@@ -371,6 +813,113 @@ static int websocket_get_id(lua_State *L) {
     return 1;
 }
 
+// Lua Usage: ws:get_handle() -> integer registry handle, or nil once closed
+static int websocket_get_handle(lua_State *L) {
+    auto **ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(luaL_checkudata(L, 1, "websocket"));
+    if (!*ws_ud || !(*ws_ud)->getUserData()->handle) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L, (*ws_ud)->getUserData()->handle);
+    return 1;
+}
+
+// Returns the live socket behind a websocket userdata, or nullptr once it has closed
+static uWS::WebSocket<false, true, WebSocketUserData>* check_live_websocket(lua_State *L, int index) {
+    auto **ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(luaL_checkudata(L, index, "websocket"));
+    if (!*ws_ud) return nullptr;
+    WebSocketUserData *userdata = (*ws_ud)->getUserData();
+    if (!userdata || userdata->is_closed || userdata->socket != *ws_ud) return nullptr;
+    return *ws_ud;
+}
+
+// Accepts "text"/"binary" like ws:send, or the integer opcode handed to message handlers
+static uWS::OpCode check_opcode(lua_State *L, int index, uWS::OpCode fallback) {
+    if (lua_type(L, index) == LUA_TNUMBER) {
+        int opcode = static_cast<int>(lua_tointeger(L, index));
+        if (opcode != uWS::OpCode::TEXT && opcode != uWS::OpCode::BINARY) {
+            luaL_argerror(L, index, "opcode must be 1 (text) or 2 (binary)");
+        }
+        return static_cast<uWS::OpCode>(opcode);
+    }
+    if (lua_type(L, index) == LUA_TSTRING) {
+        const char *type = lua_tostring(L, index);
+        if (strcmp(type, "binary") == 0) return uWS::OpCode::BINARY;
+        if (strcmp(type, "text") == 0) return uWS::OpCode::TEXT;
+        luaL_argerror(L, index, "opcode must be \"text\" or \"binary\"");
+    }
+    return fallback;
+}
+
+// Lua Usage: ws:subscribe(topic) -> boolean
+static int websocket_subscribe(lua_State *L) {
+    auto *ws = check_live_websocket(L, 1);
+    size_t len;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "Socket is closed");
+        return 2;
+    }
+    lua_pushboolean(L, ws->subscribe(std::string_view(topic, len)));
+    return 1;
+}
+
+// Lua Usage: ws:unsubscribe(topic) -> boolean
+static int websocket_unsubscribe(lua_State *L) {
+    auto *ws = check_live_websocket(L, 1);
+    size_t len;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "Socket is closed");
+        return 2;
+    }
+    lua_pushboolean(L, ws->unsubscribe(std::string_view(topic, len)));
+    return 1;
+}
+
+// Lua Usage: ws:is_subscribed(topic) -> boolean
+static int websocket_is_subscribed(lua_State *L) {
+    auto *ws = check_live_websocket(L, 1);
+    size_t len;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    lua_pushboolean(L, ws && ws->isSubscribed(std::string_view(topic, len)));
+    return 1;
+}
+
+// Lua Usage: ws:get_topics() -> { "room:1", ... }
+static int websocket_get_topics(lua_State *L) {
+    auto *ws = check_live_websocket(L, 1);
+    lua_newtable(L);
+    if (ws) {
+        int n = 0;
+        ws->iterateTopics([L, &n](std::string_view topic) {
+            lua_pushlstring(L, topic.data(), topic.size());
+            lua_rawseti(L, -2, ++n);
+        });
+    }
+    return 1;
+}
+
+// Lua Usage: ws:publish(topic, message [, "text"|"binary" [, compress]]) -> boolean
+// Reaches every subscriber of `topic` except this socket; the frame is built once.
+static int websocket_publish(lua_State *L) {
+    auto *ws = check_live_websocket(L, 1);
+    size_t topic_len, message_len;
+    const char *topic = luaL_checklstring(L, 2, &topic_len);
+    const char *message = luaL_checklstring(L, 3, &message_len);
+    uWS::OpCode opcode = check_opcode(L, 4, uWS::OpCode::TEXT);
+    bool compress = lua_isnoneornil(L, 5) ? ws && ws->getUserData()->compress : lua_toboolean(L, 5);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "Socket is closed");
+        return 2;
+    }
+    lua_pushboolean(L, ws->publish(std::string_view(topic, topic_len), std::string_view(message, message_len), opcode, compress));
+    return 1;
+}
+
 // Add metadata access methods to websocket metatable
 static void create_websocket_metatable(lua_State *L) {
     luaL_newmetatable(L, "websocket");
@@ -384,6 +933,22 @@ static void create_websocket_metatable(lua_State *L) {
     lua_setfield(L, -2, "close");
     lua_pushcfunction(L, websocket_get_id);
     lua_setfield(L, -2, "get_id");
+    lua_pushcfunction(L, websocket_get_handle);
+    lua_setfield(L, -2, "get_handle");
+    lua_pushcfunction(L, websocket_get_buffered_amount);
+    lua_setfield(L, -2, "get_buffered_amount");
+
+    // Pub/sub on the app's topic tree
+    lua_pushcfunction(L, websocket_subscribe);
+    lua_setfield(L, -2, "subscribe");
+    lua_pushcfunction(L, websocket_unsubscribe);
+    lua_setfield(L, -2, "unsubscribe");
+    lua_pushcfunction(L, websocket_is_subscribed);
+    lua_setfield(L, -2, "is_subscribed");
+    lua_pushcfunction(L, websocket_get_topics);
+    lua_setfield(L, -2, "get_topics");
+    lua_pushcfunction(L, websocket_publish);
+    lua_setfield(L, -2, "publish");
     
     // New metadata methods
     lua_pushcfunction(L, [](lua_State *L) -> int {
@@ -458,133 +1023,409 @@ static void create_websocket_metatable(lua_State *L) {
 //     lua_pop(L, 1); // Pop the metatable
 // }
 
-static void create_metatables(lua_State *L) {
-    create_websocket_metatable(L);
-    luaL_newmetatable(L, "req");
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, [](lua_State *L) -> int {
-        uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-        const char *key = luaL_checkstring(L, 2);
-        if (strcmp(key, "method") == 0) {
-            lua_pushstring(L, (*req)->getMethod().data());
-            return 1;
-        } else if (strcmp(key, "url") == 0) {
-            lua_pushstring(L, (*req)->getUrl().data());
-            return 1;
-        } else if (strcmp(key, "query") == 0) {
-            lua_pushstring(L, (*req)->getQuery().data());
-            return 1;
-        } else if (strcmp(key, "getHeader") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-                const char *header_name = luaL_checkstring(L, 2);
-                std::string_view header_value = (*req)->getHeader(header_name);
-                lua_pushlstring(L, header_value.data(), header_value.length());
-                return 1;
-            }, 0);
-            return 1;
-        } // Inside the lambda for the '__index' metamethod of 'req'
-        else if (strcmp(key, "getUrl") == 0) {
-            lua_pushcfunction(L, [](lua_State *L) -> int {
-                uWS::HttpRequest** req = (uWS::HttpRequest**)luaL_checkudata(L, 1, "req");
-                std::string_view url = (*req)->getUrl();
-                lua_pushlstring(L, url.data(), url.length());
-                return 1;
-            });
-            return 1;
-        }
-
-        lua_pushnil(L);
-        return 1;
-    });
-    lua_settable(L, -3);
-    lua_pop(L, 1);
-
-    luaL_newmetatable(L, "res");
-    lua_pushstring(L, "__index");
-    lua_pushcfunction(L, [](lua_State *L) -> int {
-        uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-        const char *key = luaL_checkstring(L, 2);
-        if (strcmp(key, "send") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-                const char *response = luaL_checkstring(L, 2);
-                (*res)->end(response);
-                return 0;
-            }, 0);
-            return 1;
-        } else if (strcmp(key, "writeHeader") == 0) {
-            lua_pushcclosure(L, [](lua_State *L) -> int {
-                uWS::HttpResponse<false>** res = (uWS::HttpResponse<false>**)luaL_checkudata(L, 1, "res");
-                const char *header = luaL_checkstring(L, 2);
-                const char *value = luaL_checkstring(L, 3);
-                (*res)->writeHeader(header, value);
-                lua_pushvalue(L, 1);
-                return 1;
-            }, 0);
-            return 1;
-        } else if (strcmp(key, "writeStatus") == 0) {
-            lua_pushcfunction(L, res_writeStatus);
-            return 1;
-        } else if (strcmp(key, "getRemoteAddress") == 0) {
-            lua_pushcfunction(L, res_getRemoteAddress);
-            return 1;
-        } else if (strcmp(key, "getProxiedRemoteAddress") == 0) {
-            lua_pushcfunction(L, res_getProxiedRemoteAddress);
-            return 1;
-        } else if (strcmp(key, "closeConnection") == 0) {
-            lua_pushcfunction(L, res_closeConnection);
-            return 1;
-        }
-        lua_pushnil(L);
-        return 1;
-    });
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+static RequestUserData* check_req(lua_State *L, int index) {
+    return static_cast<RequestUserData*>(luaL_checkudata(L, index, "req"));
 }
 
-// Function to execute middleware
-bool execute_middleware(lua_State *L, uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const std::string& route) {
-    for (const auto& mw : middlewares) {
-        if (mw.global || mw.route == route) {
-            lua_rawgeti(L, LUA_REGISTRYINDEX, mw.ref);
-            create_req_userdata(L, req);
-            create_res_userdata(L, res);
-            if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
-                std::cerr << "Lua middleware error: " << lua_tostring(L, -1) << std::endl;
-                lua_pop(L, 1);
-                return false; // Middleware error, stop processing
-            }
-
-            if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
-                lua_pop(L, 1); // Remove boolean return
-                return false; // Middleware returned false, stop processing
-            }
-            lua_pop(L, 1); // Remove boolean return
-        }
+// The request's snapshot, taken now if there is none yet
+static RequestSnapshot* ensure_request_snapshot(lua_State *L, int index) {
+    RequestUserData *data = check_req(L, index);
+    if (!data->snapshot) {
+        if (!data->req) luaL_error(L, "request is no longer available");
+        attach_request_snapshot(L, index, std::make_shared<RequestSnapshot>(*data->req));
     }
-    return true; // Continue processing if no middleware returned false
+    return data->snapshot;
 }
 
-// Function to add middleware
-int uw_use(lua_State *L) {
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    lua_pushvalue(L, 1);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+// Lua Usage: req:getHeader("content-type") -> string ("" when absent)
+static int req_getHeader(lua_State *L) {
+    RequestUserData *data = check_req(L, 1);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    std::string_view value;
+    if (data->snapshot) {
+        value = data->snapshot->header(std::string_view(name, len));
+    } else if (data->req) {
+        value = data->req->getHeader(std::string_view(name, len));
+    }
+    lua_pushlstring(L, value.data(), value.size());
+    return 1;
+}
 
-    Middleware mw;
-    mw.ref = ref;
-    mw.global = true;
+static int req_getUrl(lua_State *L) {
+    RequestUserData *data = check_req(L, 1);
+    std::string_view url = data->snapshot ? data->snapshot->url : data->req ? data->req->getUrl() : std::string_view();
+    lua_pushlstring(L, url.data(), url.size());
+    return 1;
+}
 
-    if (lua_gettop(L) > 1 && lua_isstring(L, 2)) {
-        mw.global = false;
-        mw.route = luaL_checkstring(L, 2);
-    }
-    middlewares.push_back(mw);
-    lua_pushboolean(L, 1);
+static int req_getMethod(lua_State *L) {
+    RequestUserData *data = check_req(L, 1);
+    std::string_view method = data->snapshot ? data->snapshot->method : data->req ? data->req->getMethod() : std::string_view();
+    lua_pushlstring(L, method.data(), method.size());
     return 1;
 }
 
+static int req_getQuery(lua_State *L) {
+    RequestUserData *data = check_req(L, 1);
+    std::string_view query = data->snapshot ? data->snapshot->query : data->req ? data->req->getQuery() : std::string_view();
+    lua_pushlstring(L, query.data(), query.size());
+    return 1;
+}
+
+// Lua Usage: req:headers() -> { ["content-type"] = "...", ... }
+// Repeated headers are joined with ", ".
+static int req_headers(lua_State *L) {
+    RequestSnapshot *snapshot = ensure_request_snapshot(L, 1);
+    lua_createtable(L, 0, static_cast<int>(snapshot->headers.size()));
+    for (const auto& header : snapshot->headers) {
+        lua_pushlstring(L, header.first.data(), header.first.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_isstring(L, -1)) {
+            lua_pushliteral(L, ", ");
+            lua_pushlstring(L, header.second.data(), header.second.size());
+            lua_concat(L, 3);
+        } else {
+            lua_pop(L, 1);
+            lua_pushlstring(L, header.second.data(), header.second.size());
+        }
+        lua_rawset(L, -3);
+    }
+    return 1;
+}
+
+// Lua Usage: req:snapshot() -> req
+// Copies the request so it can still be read after the handler returns.
+static int req_snapshot(lua_State *L) {
+    ensure_request_snapshot(L, 1);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int req_snapshot_gc(lua_State *L) {
+    auto *holder = static_cast<std::shared_ptr<RequestSnapshot>*>(luaL_checkudata(L, 1, "req.snapshot"));
+    holder->~shared_ptr();
+    return 0;
+}
+
+// Methods come from a real table (upvalue 1); only the method/url/query fields fall
+// through to the request itself.
+static int req_index(lua_State *L) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1);
+
+    const char *key = luaL_checkstring(L, 2);
+    if (strcmp(key, "method") == 0) return req_getMethod(L);
+    if (strcmp(key, "url") == 0) return req_getUrl(L);
+    if (strcmp(key, "query") == 0) return req_getQuery(L);
+
+    lua_pushnil(L);
+    return 1;
+}
+
+static void create_metatables(lua_State *L) {
+    create_websocket_metatable(L);
+
+    luaL_newmetatable(L, "req.snapshot");
+    lua_pushcfunction(L, req_snapshot_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, "req");
+    lua_newtable(L);
+    lua_pushcfunction(L, req_getHeader);
+    lua_setfield(L, -2, "getHeader");
+    lua_pushcfunction(L, req_getUrl);
+    lua_setfield(L, -2, "getUrl");
+    lua_pushcfunction(L, req_getMethod);
+    lua_setfield(L, -2, "getMethod");
+    lua_pushcfunction(L, req_getQuery);
+    lua_setfield(L, -2, "getQuery");
+    lua_pushcfunction(L, req_headers);
+    lua_setfield(L, -2, "headers");
+    lua_pushcfunction(L, req_snapshot);
+    lua_setfield(L, -2, "snapshot");
+    lua_pushcclosure(L, req_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    // res methods live in a prebuilt table, like the websocket metatable's
+    luaL_newmetatable(L, "res");
+    lua_newtable(L);
+    lua_pushcfunction(L, res_send);
+    lua_setfield(L, -2, "send");
+    lua_pushcfunction(L, res_json);
+    lua_setfield(L, -2, "json");
+    lua_pushcfunction(L, res_writeHeader);
+    lua_setfield(L, -2, "writeHeader");
+    lua_pushcfunction(L, res_writeHeaders);
+    lua_setfield(L, -2, "writeHeaders");
+    lua_pushcfunction(L, res_writeStatus);
+    lua_setfield(L, -2, "writeStatus");
+    lua_pushcfunction(L, res_writeStatus);
+    lua_setfield(L, -2, "status");
+    lua_pushcfunction(L, res_getRemoteAddress);
+    lua_setfield(L, -2, "getRemoteAddress");
+    lua_pushcfunction(L, res_getProxiedRemoteAddress);
+    lua_setfield(L, -2, "getProxiedRemoteAddress");
+    lua_pushcfunction(L, res_closeConnection);
+    lua_setfield(L, -2, "closeConnection");
+    lua_pushcfunction(L, res_stream);
+    lua_setfield(L, -2, "stream");
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
+// Scopes are matched against route patterns: "/api/*" covers "/api" and everything
+// registered below "/api/", any other scope only the identical pattern
+static bool middleware_applies(const Middleware& mw, const std::string& route) {
+    if (mw.global) return true;
+    if (!mw.prefix) return mw.route == route;
+    if (route.compare(0, mw.route.size(), mw.route) == 0) return true;
+    // "/api/" also covers "/api" itself
+    return route.size() + 1 == mw.route.size() && mw.route.compare(0, route.size(), route) == 0;
+}
+
+// Builds the chain for a route from the middlewares registered so far
+static int compile_middleware_chain(const std::string& route) {
+    MiddlewareChain chain;
+    chain.route = route;
+    for (const auto& mw : middlewares) {
+        if (middleware_applies(mw, route)) chain.refs.push_back(mw.ref);
+    }
+    middleware_chains.push_back(std::move(chain));
+    return static_cast<int>(middleware_chains.size() - 1);
+}
+
+// Function to execute middleware; req is the live uWS::HttpRequest* or a RequestSnapshot
+template <typename Request>
+bool execute_middleware(lua_State *L, uWS::HttpResponse<false> *res, const Request& req, int chain) {
+    const std::vector<int>& refs = middleware_chains[chain].refs;
+    for (size_t i = 0; i < refs.size(); i++) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, refs[i]);
+        create_req_userdata(L, req);
+        create_res_userdata(L, res);
+        if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+            std::cerr << "Lua middleware error: " << lua_tostring(L, -1) << std::endl;
+            lua_pop(L, 1);
+            return false; // Middleware error, stop processing
+        }
+
+        if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+            lua_pop(L, 1); // Remove boolean return
+            return false; // Middleware returned false, stop processing
+        }
+        lua_pop(L, 1); // Remove boolean return
+    }
+    return true; // Continue processing if no middleware returned false
+}
+
+// Function to add middleware
+// Expected usage: app.use(fn) for every route, app.use(fn, "/login") for one route,
+// app.use(fn, "/api/*") for every route under /api
+int uw_use(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushvalue(L, 1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    Middleware mw;
+    mw.ref = ref;
+    mw.global = true;
+
+    if (lua_gettop(L) > 1 && lua_isstring(L, 2)) {
+        mw.global = false;
+        mw.route = luaL_checkstring(L, 2);
+        if (mw.route.size() >= 2 && mw.route.compare(mw.route.size() - 2, 2, "/*") == 0) {
+            mw.prefix = true;
+            mw.route.pop_back(); // Keep the trailing slash
+        } else if (mw.route == "*") {
+            mw.global = true;
+        }
+    }
+    middlewares.push_back(mw);
+
+    // Routes registered before this call pick it up too
+    for (auto& chain : middleware_chains) {
+        if (middleware_applies(mw, chain.route)) chain.refs.push_back(ref);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Async route handlers ({ async = true }) run as coroutines from a per-thread pool and
+// may call app.await / app.sleep / app.await_read_file / app.await_write_file, which
+// suspend the handler until the operation completes. The request they see is a
+// snapshot, since uWS::HttpRequest dies at the first suspension. An aborted request
+// cancels its handler: it is never resumed and late completions are dropped.
+struct AsyncRequest {
+    lua_State *co = nullptr;
+    int co_ref = LUA_NOREF;
+    uWS::HttpResponse<false> *res = nullptr; // Detached once the response has been sent
+    int res_ref = LUA_NOREF;   // The handler's res userdata, emptied on detach
+    const char *label = "";
+    uint64_t wait_token = 0;   // Set while suspended in an await
+    int early_result_ref = LUA_NOREF; // Results delivered before the handler managed to yield
+    bool running = false;
+    bool aborted = false;
+};
+
+static constexpr size_t COROUTINE_POOL_MAX = 256;
+static thread_local std::vector<int> coroutine_pool; // Registry refs of idle coroutines
+static thread_local std::unordered_map<lua_State*, std::shared_ptr<AsyncRequest>> async_by_thread;
+static thread_local std::unordered_map<uWS::HttpResponse<false>*, std::shared_ptr<AsyncRequest>> async_by_response;
+static thread_local std::unordered_map<uint64_t, std::shared_ptr<AsyncRequest>> async_waiting;
+static thread_local uint64_t async_wait_counter = 0;
+
+static void acquire_coroutine(AsyncRequest& ctx) {
+    if (!coroutine_pool.empty()) {
+        ctx.co_ref = coroutine_pool.back();
+        coroutine_pool.pop_back();
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ctx.co_ref);
+        ctx.co = lua_tothread(main_L, -1);
+        lua_pop(main_L, 1);
+        return;
+    }
+    ctx.co = lua_newthread(main_L);
+    ctx.co_ref = luaL_ref(main_L, LUA_REGISTRYINDEX);
+}
+
+// Forgets the response once it has ended: uWS drops its onAborted then and may reuse
+// the HttpResponse for the next request on the socket, so neither C++ nor the
+// handler's res may touch it afterwards
+static void detach_async_response(AsyncRequest& ctx) {
+    if (!ctx.res) return;
+    auto it = async_by_response.find(ctx.res);
+    if (it != async_by_response.end() && it->second.get() == &ctx) async_by_response.erase(it);
+    ctx.res = nullptr;
+    if (ctx.res_ref != LUA_NOREF) {
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ctx.res_ref);
+        *static_cast<uWS::HttpResponse<false>**>(lua_touserdata(main_L, -1)) = nullptr;
+        lua_pop(main_L, 1);
+    }
+}
+
+// A coroutine whose function returned normally can run another handler; one that
+// failed or is still suspended cannot, and is left to the garbage collector
+static void release_coroutine(AsyncRequest& ctx, bool reusable) {
+    async_by_thread.erase(ctx.co);
+    if (ctx.res && ctx.res->hasResponded()) {
+        detach_async_response(ctx);
+    } else if (ctx.res) {
+        auto it = async_by_response.find(ctx.res);
+        if (it != async_by_response.end() && it->second.get() == &ctx) async_by_response.erase(it);
+    }
+    if (ctx.res_ref != LUA_NOREF) {
+        luaL_unref(main_L, LUA_REGISTRYINDEX, ctx.res_ref);
+        ctx.res_ref = LUA_NOREF;
+    }
+    // A resume() kept past the handler's end must not find it again
+    if (ctx.wait_token) {
+        async_waiting.erase(ctx.wait_token);
+        ctx.wait_token = 0;
+    }
+    if (ctx.early_result_ref != LUA_NOREF) {
+        luaL_unref(main_L, LUA_REGISTRYINDEX, ctx.early_result_ref);
+        ctx.early_result_ref = LUA_NOREF;
+    }
+    if (reusable && lua_status(ctx.co) == 0 && coroutine_pool.size() < COROUTINE_POOL_MAX) {
+        lua_settop(ctx.co, 0);
+        coroutine_pool.push_back(ctx.co_ref);
+    } else {
+        luaL_unref(main_L, LUA_REGISTRYINDEX, ctx.co_ref);
+    }
+    ctx.co = nullptr;
+    ctx.co_ref = LUA_NOREF;
+}
+
+// Resumes the handler with nargs values already pushed on its stack
+static void step_async_request(const std::shared_ptr<AsyncRequest>& ctx, int nargs) {
+    ctx->running = true;
+    int status = lua_resume(ctx->co, nargs);
+    ctx->running = false;
+
+    if (status == LUA_YIELD) {
+        if (ctx->wait_token) return; // Suspended in an await
+        lua_settop(ctx->co, 0);
+        lua_pushstring(ctx->co, "async handlers may only suspend through app.await");
+        status = LUA_ERRRUN;
+    }
+
+    if (status != 0) {
+        std::cerr << "Lua error in async " << ctx->label << " handler: " << lua_tostring(ctx->co, -1) << std::endl;
+        if (!ctx->aborted && ctx->res && !ctx->res->hasResponded()) {
+            ctx->res->writeStatus("500 Internal Server Error")->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
+        }
+        release_coroutine(*ctx, false);
+        return;
+    }
+    release_coroutine(*ctx, true);
+}
+
+static void cancel_async_request(const std::shared_ptr<AsyncRequest>& ctx) {
+    if (ctx->aborted || !ctx->co) return;
+    ctx->aborted = true;
+    if (ctx->wait_token) {
+        async_waiting.erase(ctx->wait_token);
+        ctx->wait_token = 0;
+    }
+    // A running handler notices on its next await; a suspended one is dropped now
+    if (!ctx->running) release_coroutine(*ctx, false);
+}
+
+// Called from onAborted handlers that replace the one installed for an async handler
+static void cancel_async_response(uWS::HttpResponse<false> *res) {
+    auto it = async_by_response.find(res);
+    if (it != async_by_response.end()) cancel_async_request(std::shared_ptr<AsyncRequest>(it->second));
+}
+
+// Called when a body written outside res:send/res:end (res:stream) completes: uWS has
+// dropped onAborted, so a handler suspended in an await must not keep the response
+static void detach_async_response(uWS::HttpResponse<false> *res) {
+    auto it = async_by_response.find(res);
+    if (it != async_by_response.end()) detach_async_response(*it->second);
+}
+
+// Starts handler(req, res, ...) as a coroutine; push_args pushes the values after req and res
+static std::shared_ptr<AsyncRequest> start_async_handler(uWS::HttpResponse<false> *res, const std::shared_ptr<RequestSnapshot>& req,
+                                                         int callback_id, const char *label, bool install_abort,
+                                                         const std::function<int(lua_State*)>& push_args = nullptr) {
+    auto ctx = std::make_shared<AsyncRequest>();
+    ctx->res = res;
+    ctx->label = label;
+    acquire_coroutine(*ctx);
+    async_by_thread[ctx->co] = ctx;
+    async_by_response[res] = ctx;
+
+    if (install_abort) {
+        res->onAborted([ctx]() {
+            std::cerr << ctx->label << " request aborted" << std::endl;
+            cancel_async_request(ctx);
+        });
+    }
+
+    lua_rawgeti(ctx->co, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+    create_req_userdata(ctx->co, req);
+    create_res_userdata(ctx->co, res);
+    lua_pushvalue(ctx->co, -1);
+    ctx->res_ref = luaL_ref(ctx->co, LUA_REGISTRYINDEX);
+    int nargs = 2 + (push_args ? push_args(ctx->co) : 0);
+    step_async_request(ctx, nargs);
+    return ctx;
+}
+
+// Reads { async = true } from a route's optional options table
+static bool read_route_async(lua_State *L, int opts) {
+    if (!lua_istable(L, opts)) return false;
+    lua_getfield(L, opts, "async");
+    bool async = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return async;
+}
+
 int uw_get(lua_State *L) {
     const char *route = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
@@ -592,10 +1433,15 @@ int uw_get(lua_State *L) {
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
+    bool async = read_route_async(L, 3);
 
-    app->get(route, [callback_id, route](auto *res, auto *req) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res, req, route)) return;
+    app->get(route, [callback_id, chain, async](auto *res, auto *req) {
+        if (!execute_middleware(main_L, res, req, chain)) return;
+        if (async) {
+            start_async_handler(res, std::make_shared<RequestSnapshot>(*req), callback_id, "GET", true);
+            return;
+        }
 
         lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
         create_req_userdata(main_L, req);
@@ -612,86 +1458,266 @@ int uw_get(lua_State *L) {
     return 1;
 }
 
+// Request bodies for POST, PUT and PATCH. Every upload is bounded by maxBody (413 past it,
+// checked against Content-Length before any byte is read) and middleware runs once, in
+// the route handler, while the request is still live.
+//   "buffer": handler(req, res, body, true [, path]) once the body is complete. With
+//             spill set, bodies past that many bytes go to a temp file instead: body is
+//             nil and path names the file, which is removed after the handler returns.
+//   "stream": handler(req, res, chunk, last) per chunk as it arrives.
+// Expected usage: app.post("/upload", fn, { body = "buffer", maxBody = 64 * 1024 * 1024, spill = 1024 * 1024 })
+struct BodyOptions {
+    enum { BUFFER = 0, STREAM = 1 };
+    int mode = BUFFER;
+    size_t max_body = 16 * 1024 * 1024;
+    size_t spill = 0; // 0: never spill, the whole body stays in memory
+    std::string temp_dir;
+    bool async = false; // Buffered handlers run as coroutines (see start_async_handler)
+};
+
+// Most a buffered body reserves before any of it has arrived; Content-Length is the
+// client's claim, so larger bodies grow the buffer as their bytes come in
+static constexpr size_t BODY_RESERVE_MAX = 64 * 1024;
+
+static BodyOptions read_body_options(lua_State *L, int opts, int default_mode) {
+    BodyOptions options;
+    options.mode = default_mode;
+    if (lua_isnoneornil(L, opts)) return options;
+    luaL_checktype(L, opts, LUA_TTABLE);
+
+    lua_getfield(L, opts, "body");
+    if (lua_isstring(L, -1)) {
+        const char *mode = lua_tostring(L, -1);
+        if (strcmp(mode, "buffer") == 0) {
+            options.mode = BodyOptions::BUFFER;
+        } else if (strcmp(mode, "stream") == 0) {
+            options.mode = BodyOptions::STREAM;
+        } else {
+            luaL_argerror(L, opts, "body must be \"buffer\" or \"stream\"");
+        }
+    }
+    lua_getfield(L, opts, "maxBody");
+    if (lua_isnumber(L, -1)) options.max_body = static_cast<size_t>(lua_tointeger(L, -1));
+    lua_getfield(L, opts, "spill");
+    if (lua_isnumber(L, -1)) options.spill = static_cast<size_t>(lua_tointeger(L, -1));
+    lua_getfield(L, opts, "tempDir");
+    if (lua_isstring(L, -1)) options.temp_dir = lua_tostring(L, -1);
+    lua_pop(L, 4);
+    options.async = read_route_async(L, opts);
+    if (options.async && options.mode == BodyOptions::STREAM) {
+        luaL_argerror(L, opts, "async handlers need body = \"buffer\"");
+    }
+
+    if (options.spill && options.temp_dir.empty()) {
+        std::error_code ec;
+        options.temp_dir = std::filesystem::temp_directory_path(ec).string();
+        if (ec) options.temp_dir = "/tmp";
+    }
+    return options;
+}
+
+// One in-flight body. In memory it never holds more than min(maxBody, spill) bytes.
+struct BodyUpload {
+    std::shared_ptr<RequestSnapshot> req;
+    size_t received = 0;
+    std::string buffer;
+    int spill_fd = -1;
+    std::string spill_path;
+    bool aborted = false;
+    bool done = false;
+    std::shared_ptr<AsyncRequest> async; // Set once an async handler has started
+
+    ~BodyUpload() {
+        if (spill_fd >= 0) close(spill_fd);
+        if (!spill_path.empty()) unlink(spill_path.c_str());
+    }
+
+    bool write_spill(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = ::write(spill_fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+        return true;
+    }
+
+    // Moves the buffered bytes into a temp file; later chunks are appended there
+    bool start_spill(const std::string& temp_dir) {
+        std::string path = temp_dir + "/uws-body-XXXXXX";
+        spill_fd = mkstemp(path.data());
+        if (spill_fd < 0) return false;
+        spill_path = path;
+        bool ok = write_spill(buffer);
+        std::string().swap(buffer);
+        return ok;
+    }
+};
+
+// A stream handler may already have answered; the rest of the body is then dropped by
+// closing the connection instead of writing a second response onto it
+static void reject_body(uWS::HttpResponse<false> *res, const char *status, const char *message) {
+    if (res->hasResponded()) {
+        res->close();
+        return;
+    }
+    res->writeStatus(status)->writeHeader("Content-Type", "text/plain")->end(message, true);
+}
+
+// Handles one request on a body route; label names the method in error logs
+static void handle_body_route(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, int callback_id, int chain,
+                              const std::shared_ptr<BodyOptions>& options, const char *label) {
+    if (!execute_middleware(main_L, res, req, chain)) return;
+
+    std::string_view length_header = req->getHeader("content-length");
+    size_t content_length = 0;
+    if (!length_header.empty()) {
+        content_length = static_cast<size_t>(strtoull(std::string(length_header).c_str(), nullptr, 10));
+        if (content_length > options->max_body) {
+            reject_body(res, "413 Content Too Large", "Payload Too Large");
+            return;
+        }
+    }
+
+    auto upload = std::make_shared<BodyUpload>();
+    upload->req = std::make_shared<RequestSnapshot>(*req); // req dies with this handler
+    if (options->mode == BodyOptions::BUFFER) {
+        size_t reserve = std::min(content_length, BODY_RESERVE_MAX);
+        if (options->spill && reserve > options->spill) reserve = options->spill;
+        upload->buffer.reserve(reserve);
+    }
+
+    res->onAborted([upload, label]() {
+        upload->aborted = true;
+        std::cerr << label << " request aborted" << std::endl;
+        if (upload->async) cancel_async_request(upload->async);
+    });
+
+    res->onData([res, upload, options, callback_id, label](std::string_view data, bool last) {
+        if (upload->aborted || upload->done) return;
+
+        upload->received += data.size();
+        if (upload->received > options->max_body) {
+            upload->done = true;
+            reject_body(res, "413 Content Too Large", "Payload Too Large");
+            return;
+        }
+
+        if (options->mode == BodyOptions::STREAM) {
+            if (last) upload->done = true;
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+            create_req_userdata(main_L, upload->req);
+            create_res_userdata(main_L, res);
+            lua_pushlstring(main_L, data.data(), data.size());
+            lua_pushboolean(main_L, last);
+            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
+                std::cerr << "Lua error in " << label << " handler: " << lua_tostring(main_L, -1) << std::endl;
+                lua_pop(main_L, 1);
+                if (!upload->aborted && !res->hasResponded()) {
+                    upload->done = true;
+                    res->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
+                }
+            }
+            return;
+        }
+
+        bool stored;
+        if (upload->spill_fd >= 0) {
+            stored = upload->write_spill(data);
+        } else if (options->spill && upload->buffer.size() + data.size() > options->spill) {
+            stored = upload->start_spill(options->temp_dir) && upload->write_spill(data);
+        } else {
+            upload->buffer.append(data.data(), data.size());
+            stored = true;
+        }
+        if (!stored) {
+            upload->done = true;
+            std::cerr << label << " body spill failed: " << strerror(errno) << std::endl;
+            reject_body(res, "500 Internal Server Error", "Internal Server Error");
+            return;
+        }
+        if (!last) return;
+
+        upload->done = true;
+        if (options->async) {
+            // The upload keeps a spilled file alive until the handler is done with it
+            upload->async = start_async_handler(res, upload->req, callback_id, label, false, [upload](lua_State *co) {
+                if (upload->spill_fd >= 0) {
+                    close(upload->spill_fd);
+                    upload->spill_fd = -1;
+                    lua_pushnil(co);
+                    lua_pushboolean(co, 1);
+                    lua_pushlstring(co, upload->spill_path.data(), upload->spill_path.size());
+                    return 3;
+                }
+                lua_pushlstring(co, upload->buffer.data(), upload->buffer.size());
+                lua_pushboolean(co, 1);
+                std::string().swap(upload->buffer);
+                return 2;
+            });
+            return;
+        }
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+        create_req_userdata(main_L, upload->req);
+        create_res_userdata(main_L, res);
+        int nargs = 4;
+        if (upload->spill_fd >= 0) {
+            close(upload->spill_fd);
+            upload->spill_fd = -1;
+            lua_pushnil(main_L);
+            lua_pushboolean(main_L, 1);
+            lua_pushlstring(main_L, upload->spill_path.data(), upload->spill_path.size());
+            nargs = 5;
+        } else {
+            lua_pushlstring(main_L, upload->buffer.data(), upload->buffer.size());
+            lua_pushboolean(main_L, 1);
+        }
+        if (lua_pcall(main_L, nargs, 0, 0) != LUA_OK) {
+            std::cerr << "Lua error in " << label << " handler: " << lua_tostring(main_L, -1) << std::endl;
+            lua_pop(main_L, 1);
+            if (!upload->aborted && !res->hasResponded()) {
+                res->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
+            }
+        }
+        // The body is no longer needed, even if the response is still being written
+        std::string().swap(upload->buffer);
+    });
+}
+
+// Expected usage: app.post(route, function(req, res, chunk, last) end [, options])
+// POST streams chunks by default; pass { body = "buffer" } to get the whole body at once.
 int uw_post(lua_State *L) {
     const char *route = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
+    auto options = std::make_shared<BodyOptions>(read_body_options(L, 3, BodyOptions::STREAM));
     lua_pushvalue(L, 2);
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
 
-    app->post(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        // std::cerr << "uw_post handler called. res_uws: " << res_uws << ", req_uws: " << req_uws << std::endl;
-        if(res_uws){
-            res_uws->onData([callback_id, res_uws, req_uws, route](std::string_view data, bool last) mutable {
-                std::lock_guard<std::mutex> lock(lua_mutex);
-                if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
-
-                lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-                create_req_userdata(main_L, req_uws);
-                create_res_userdata(main_L, res_uws);
-                lua_pushlstring(main_L, data.data(), data.size());
-                lua_pushboolean(main_L, last);
-
-                if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                    std::cerr << "Lua error in POST handler: " << lua_tostring(main_L, -1) << std::endl;
-                    lua_pop(main_L, 1);
-                    res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-                }
-            });
-
-            res_uws->onAborted([]() {
-                std::cerr << "POST request aborted" << std::endl;
-            });
-
-        }else{
-            std::cerr << "Error: res_uws is NULL in POST handler!" << std::endl;
-        }
+    app->post(route, [callback_id, chain, options](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        handle_body_route(res_uws, req_uws, callback_id, chain, options, "POST");
     });
     lua_pushboolean(L, 1);
     return 1;
 }
 
+// Expected usage: app.put(route, function(req, res, body, last [, path]) end [, options])
 int uw_put(lua_State *L) {
     const char *route = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
+    auto options = std::make_shared<BodyOptions>(read_body_options(L, 3, BodyOptions::BUFFER));
     lua_pushvalue(L, 2);
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
 
-    app->put(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        if (res_uws) {
-            std::shared_ptr<std::string> body = std::make_shared<std::string>();
-
-            res_uws->onData([callback_id, res_uws, req_uws, route, body](std::string_view data, bool last) mutable {
-                body->append(data.data(), data.size());
-
-                if (last) {
-                    std::lock_guard<std::mutex> lock(lua_mutex);
-                    if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
-
-                    lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-                    create_req_userdata(main_L, req_uws);
-                    create_res_userdata(main_L, res_uws);
-                    lua_pushlstring(main_L, data.data(), data.size()); // This passes the *last* chunk, not the full body
-                    lua_pushboolean(main_L, last);
-
-                    if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
-                        std::cerr << "Lua error in PUT handler: " << lua_tostring(main_L, -1) << std::endl;
-                        lua_pop(main_L, 1);
-                        res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-                    }
-                }
-            });
-
-            res_uws->onAborted([]() {
-                std::cerr << "PUT request aborted" << std::endl;
-            });
-
-        } else {
-            std::cerr << "Error: res_uws is NULL in PUT handler!" << std::endl;
-        }
+    app->put(route, [callback_id, chain, options](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        handle_body_route(res_uws, req_uws, callback_id, chain, options, "PUT");
     });
 
     lua_pushboolean(L, 1);
@@ -706,10 +1732,15 @@ int uw_delete(lua_State *L) {
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
+    bool async = read_route_async(L, 3);
 
-    app->del(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+    app->del(route, [callback_id, chain, async](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        if (!execute_middleware(main_L, res_uws, req_uws, chain)) return;
+        if (async) {
+            start_async_handler(res_uws, std::make_shared<RequestSnapshot>(*req_uws), callback_id, "DELETE", true);
+            return;
+        }
 
         lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
         create_req_userdata(main_L, req_uws);
@@ -725,37 +1756,19 @@ int uw_delete(lua_State *L) {
     return 1;
 }
 
+// Expected usage: app.patch(route, function(req, res, body) end [, options])
 int uw_patch(lua_State *L) {
     const char *route = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
+    auto options = std::make_shared<BodyOptions>(read_body_options(L, 3, BodyOptions::BUFFER));
     lua_pushvalue(L, 2);
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
 
-    app->patch(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::string body;
-        res_uws->onData([callback_id, res_uws, &body, req_uws, route](std::string_view data, bool last) mutable {
-            body.append(data.data(), data.size());
-            if (last) {
-                std::lock_guard<std::mutex> lock(lua_mutex);
-                if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
-
-                lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-                create_req_userdata(main_L, req_uws);
-                create_res_userdata(main_L, res_uws);
-                lua_pushlstring(main_L, body.data(), body.size());
-
-                if (lua_pcall(main_L, 3, 0, 0) != LUA_OK) {
-                    std::cerr << "Lua error in PATCH handler: " << lua_tostring(main_L, -1) << std::endl;
-                    lua_pop(main_L, 1);
-                    res_uws->writeHeader("Content-Type", "text/plain")->end("Internal Server Error");
-                }
-            }
-        });
-        res_uws->onAborted([]() {
-            std::cerr << "PATCH request aborted" << std::endl;
-        });
+    app->patch(route, [callback_id, chain, options](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        handle_body_route(res_uws, req_uws, callback_id, chain, options, "PATCH");
     });
     lua_pushboolean(L, 1);
     return 1;
@@ -768,10 +1781,15 @@ int uw_head(lua_State *L) {
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
+    bool async = read_route_async(L, 3);
 
-    app->head(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+    app->head(route, [callback_id, chain, async](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        if (!execute_middleware(main_L, res_uws, req_uws, chain)) return;
+        if (async) {
+            start_async_handler(res_uws, std::make_shared<RequestSnapshot>(*req_uws), callback_id, "HEAD", true);
+            return;
+        }
 
         lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
         create_req_userdata(main_L, req_uws);
@@ -794,10 +1812,15 @@ int uw_options(lua_State *L) {
     int ref = luaL_ref(L, LUA_REGISTRYINDEX);
     int callback_id = callback_id_counter++;
     lua_callbacks[callback_id] = ref;
+    int chain = compile_middleware_chain(route);
+    bool async = read_route_async(L, 3);
 
-    app->options(route, [callback_id, route](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res_uws, req_uws, route)) return;
+    app->options(route, [callback_id, chain, async](uWS::HttpResponse<false> *res_uws, uWS::HttpRequest *req_uws) {
+        if (!execute_middleware(main_L, res_uws, req_uws, chain)) return;
+        if (async) {
+            start_async_handler(res_uws, std::make_shared<RequestSnapshot>(*req_uws), callback_id, "OPTIONS", true);
+            return;
+        }
 
         lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
         create_req_userdata(main_L, req_uws);
@@ -813,21 +1836,58 @@ int uw_options(lua_State *L) {
     return 1;
 }
 
-// Function to generate a simple unique ID
-std::string generate_unique_id() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<> distrib(0, 15);
+// SplitMix64 over a per-thread random seed. Its output function is a bijection of the
+// incrementing state, so a thread never repeats an id; distinct seeds keep threads apart.
+uint64_t generate_unique_id_value() {
+    static thread_local uint64_t state = [] {
+        std::random_device rd;
+        uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        seed ^= static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        seed ^= std::hash<std::thread::id>{}(std::this_thread::get_id());
+        return seed;
+    }();
+
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    std::stringstream ss;
+// 16 hex digits with dashes after the 4th, 6th, 8th and 10th, as ids have always looked
+std::string format_unique_id(uint64_t value) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[20];
+    int pos = 0;
     for (int i = 0; i < 16; ++i) {
-        int val = distrib(gen);
-        ss << std::hex << val;
+        buf[pos++] = hex[(value >> (60 - 4 * i)) & 0xF];
         if (i == 3 || i == 5 || i == 7 || i == 9) {
-            ss << "-";
+            buf[pos++] = '-';
+        }
+    }
+    return std::string(buf, sizeof(buf));
+}
+
+bool parse_unique_id(std::string_view text, uint64_t &value) {
+    if (text.size() != 20) return false;
+    uint64_t result = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (i == 4 || i == 7 || i == 10 || i == 13) {
+            if (c != '-') return false;
+            continue;
         }
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else return false;
+        result = (result << 4) | static_cast<uint64_t>(digit);
     }
-    return ss.str();
+    value = result;
+    return true;
+}
+
+std::string generate_unique_id() {
+    return format_unique_id(generate_unique_id_value());
 }
 
 
@@ -845,51 +1905,414 @@ std::string generate_unique_id() {
 //     return 1;
 // }
 
-int uw_ws(lua_State *L) {
-    const char *route_c_str = luaL_checkstring(L, 1);
-    std::string route = route_c_str; // Explicitly convert to std::string
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    int callback_id = callback_id_counter++;
-    lua_callbacks[callback_id] = ref;
+// Lua Usage: app.publish(topic, message [, "text"|"binary" [, compress]]) -> boolean
+// Broadcasts to every subscriber of `topic` on this app with one shared frame.
+// In create_cluster mode each worker has its own app, so this reaches the calling worker only.
+int uw_publish(lua_State *L) {
+    if (!app) {
+        luaL_error(L, "uWS::App not initialized. Call create_app first.");
+    }
+    int arg = first_arg_index(L);
+    size_t topic_len, message_len;
+    const char *topic = luaL_checklstring(L, arg, &topic_len);
+    const char *message = luaL_checklstring(L, arg + 1, &message_len);
+    uWS::OpCode opcode = check_opcode(L, arg + 2, uWS::OpCode::TEXT);
+    bool compress = lua_toboolean(L, arg + 3);
+
+    lua_pushboolean(L, app->publish(std::string_view(topic, topic_len), std::string_view(message, message_len), opcode, compress));
+    return 1;
+}
 
-    app->ws<WebSocketUserData>(route, {
-        .open = [callback_id, route](auto *ws) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
-            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+// Lua Usage: app.num_subscribers(topic) -> integer
+int uw_num_subscribers(lua_State *L) {
+    if (!app) {
+        luaL_error(L, "uWS::App not initialized. Call create_app first.");
+    }
+    size_t topic_len;
+    const char *topic = luaL_checklstring(L, first_arg_index(L), &topic_len);
+    lua_pushinteger(L, app->numSubscribers(std::string_view(topic, topic_len)));
+    return 1;
+}
 
-            // Set WebSocket pointer in userdata
-            WebSocketUserData* data = ws->getUserData();
-            data->id = generate_unique_id();
-            data->socket = ws;
-            data->is_closed = false;
+// Per-route WebSocket settings; defaults are uWS's own
+struct WebSocketOptions {
+    uWS::CompressOptions compression = uWS::DISABLED;
+    unsigned int maxPayloadLength = 16 * 1024;
+    unsigned short idleTimeout = 120;
+    unsigned int maxBackpressure = 64 * 1024;
+    bool closeOnBackpressureLimit = false;
+    bool resetIdleTimeoutOnSend = false;
+    bool sendPingsAutomatically = true;
+    unsigned short maxLifetime = 0;
+    int batch = 0; // 0 = off, otherwise WebSocketBatch::PER_CONNECTION or PER_ROUTE
+    size_t batchMax = 1024;
+};
 
-            // Create Lua userdata and store ws pointer
-            auto **ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(
-                lua_newuserdata(main_L, sizeof(*ws_ud)));
-            *ws_ud = ws;
-            luaL_getmetatable(main_L, "websocket");
-            lua_setmetatable(main_L, -2);
+// Opt-in batching of .message events. Frames arriving during one loop iteration are
+// collected and handed to Lua from a loop post handler as arrays, so one C -> Lua
+// transition covers many messages.
+//   per connection: handler(ws, "messages", { msg, ... }, { opcode, ... }) once per socket
+//   per route:      handler({ ws, ... }, "messages", { msg, ... }, { opcode, ... }) once,
+//                   where sockets[i] sent messages[i]
+struct WebSocketBatch {
+    enum { PER_CONNECTION = 1, PER_ROUTE = 2 };
+
+    int callback_id = 0;
+    int mode = PER_CONNECTION;
+    size_t max_messages = 1024; // Flushed early when reached
+    std::vector<uWS::WebSocket<false, true, WebSocketUserData>*> sockets;
+    std::vector<std::string> messages;
+    std::vector<uWS::OpCode> opcodes;
+
+    // Sockets closed by Lua while a flush is running; their remaining messages are skipped
+    bool flushing = false;
+    std::unordered_set<uWS::WebSocket<false, true, WebSocketUserData>*> closed;
+};
 
-            lua_pushstring(main_L, "open");
+// Batches live as long as the thread's loop, which owns their post handlers
+static thread_local std::vector<std::unique_ptr<WebSocketBatch>> websocket_batches;
 
-            if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-                std::cerr << "Lua error (open): " << lua_tostring(main_L, -1) << std::endl;
-                lua_pop(main_L, 1);
-            }
-        },
+static void push_batch_arrays(lua_State *L, const std::vector<std::string>& messages,
+                              const std::vector<uWS::OpCode>& opcodes, const std::vector<size_t>& indices) {
+    lua_createtable(L, static_cast<int>(indices.size()), 0);
+    for (size_t i = 0; i < indices.size(); i++) {
+        const std::string& message = messages[indices[i]];
+        lua_pushlstring(L, message.data(), message.size());
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+    lua_createtable(L, static_cast<int>(indices.size()), 0);
+    for (size_t i = 0; i < indices.size(); i++) {
+        lua_pushinteger(L, static_cast<int>(opcodes[indices[i]]));
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+}
+
+static void flush_websocket_batch(WebSocketBatch& batch) {
+    if (batch.messages.empty() || batch.flushing) return;
+
+    // Take the pending messages so anything arriving from inside Lua starts a new batch
+    std::vector<uWS::WebSocket<false, true, WebSocketUserData>*> sockets;
+    std::vector<std::string> messages;
+    std::vector<uWS::OpCode> opcodes;
+    sockets.swap(batch.sockets);
+    messages.swap(batch.messages);
+    opcodes.swap(batch.opcodes);
+    batch.flushing = true;
+
+    if (batch.mode == WebSocketBatch::PER_ROUTE) {
+        std::vector<size_t> indices(messages.size());
+        for (size_t i = 0; i < indices.size(); i++) indices[i] = i;
+
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[batch.callback_id]);
+        lua_createtable(main_L, static_cast<int>(sockets.size()), 0);
+        for (size_t i = 0; i < sockets.size(); i++) {
+            push_websocket_userdata(main_L, sockets[i]);
+            lua_rawseti(main_L, -2, static_cast<int>(i + 1));
+        }
+        lua_pushstring(main_L, "messages");
+        push_batch_arrays(main_L, messages, opcodes, indices);
+        if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
+            std::cerr << "Lua error (messages): " << lua_tostring(main_L, -1) << std::endl;
+            lua_pop(main_L, 1);
+        }
+    } else {
+        // Group by socket, keeping both the order of sockets and of each socket's messages
+        std::vector<uWS::WebSocket<false, true, WebSocketUserData>*> order;
+        std::unordered_map<uWS::WebSocket<false, true, WebSocketUserData>*, std::vector<size_t>> groups;
+        for (size_t i = 0; i < sockets.size(); i++) {
+            std::vector<size_t>& group = groups[sockets[i]];
+            if (group.empty()) order.push_back(sockets[i]);
+            group.push_back(i);
+        }
+
+        for (auto *ws : order) {
+            if (batch.closed.count(ws)) continue;
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[batch.callback_id]);
+            push_websocket_userdata(main_L, ws);
+            lua_pushstring(main_L, "messages");
+            push_batch_arrays(main_L, messages, opcodes, groups[ws]);
+            if (lua_pcall(main_L, 4, 0, 0) != LUA_OK) {
+                std::cerr << "Lua error (messages): " << lua_tostring(main_L, -1) << std::endl;
+                lua_pop(main_L, 1);
+            }
+        }
+    }
+
+    batch.flushing = false;
+    batch.closed.clear();
+
+    // Keep the buffers' capacity for the next iteration
+    if (batch.messages.empty()) {
+        sockets.clear();
+        messages.clear();
+        opcodes.clear();
+        batch.sockets.swap(sockets);
+        batch.messages.swap(messages);
+        batch.opcodes.swap(opcodes);
+    }
+}
+
+static WebSocketBatch* create_websocket_batch(int callback_id, const WebSocketOptions& options) {
+    auto batch = std::make_unique<WebSocketBatch>();
+    batch->callback_id = callback_id;
+    batch->mode = options.batch;
+    batch->max_messages = options.batchMax;
+
+    WebSocketBatch *raw = batch.get();
+    uWS::Loop::get()->addPostHandler(raw, [raw](uWS::Loop *) {
+        flush_websocket_batch(*raw);
+    });
+    websocket_batches.push_back(std::move(batch));
+    return raw;
+}
+
+// Unhooks every batch from the loop; called once the app and its sockets are gone
+static void clear_websocket_batches() {
+    for (auto& batch : websocket_batches) {
+        uWS::Loop::get()->removePostHandler(batch.get());
+    }
+    websocket_batches.clear();
+}
+
+// Dedicated compressor sliding windows in KB and their uWS flags
+static uWS::CompressOptions dedicated_compressor(lua_State *L, int opts, int window_kb) {
+    switch (window_kb) {
+        case 3: return uWS::DEDICATED_COMPRESSOR_3KB;
+        case 4: return uWS::DEDICATED_COMPRESSOR_4KB;
+        case 8: return uWS::DEDICATED_COMPRESSOR_8KB;
+        case 16: return uWS::DEDICATED_COMPRESSOR_16KB;
+        case 32: return uWS::DEDICATED_COMPRESSOR_32KB;
+        case 64: return uWS::DEDICATED_COMPRESSOR_64KB;
+        case 128: return uWS::DEDICATED_COMPRESSOR_128KB;
+        case 256: return uWS::DEDICATED_COMPRESSOR_256KB;
+    }
+    luaL_argerror(L, opts, "compressorWindow must be 3, 4, 8, 16, 32, 64, 128 or 256 (KB)");
+    return uWS::DISABLED;
+}
+
+static uWS::CompressOptions dedicated_decompressor(lua_State *L, int opts, int window_kb) {
+    switch (window_kb) {
+        case 1: return uWS::DEDICATED_DECOMPRESSOR_1KB;
+        case 2: return uWS::DEDICATED_DECOMPRESSOR_2KB;
+        case 4: return uWS::DEDICATED_DECOMPRESSOR_4KB;
+        case 8: return uWS::DEDICATED_DECOMPRESSOR_8KB;
+        case 16: return uWS::DEDICATED_DECOMPRESSOR_16KB;
+        case 32: return uWS::DEDICATED_DECOMPRESSOR_32KB;
+    }
+    luaL_argerror(L, opts, "decompressorWindow must be 1, 2, 4, 8, 16 or 32 (KB)");
+    return uWS::DISABLED;
+}
+
+// Reads the optional options table of app.ws(). compression is false/"disabled", true/"shared"
+// (one compressor shared by all sockets, lowest memory) or "dedicated" (per-socket sliding
+// window, best ratio), with compressorWindow/decompressorWindow choosing the dedicated sizes.
+static WebSocketOptions read_websocket_options(lua_State *L, int opts) {
+    WebSocketOptions options;
+    if (lua_isnoneornil(L, opts)) return options;
+    luaL_checktype(L, opts, LUA_TTABLE);
+
+    lua_getfield(L, opts, "compression");
+    if (lua_isboolean(L, -1)) {
+        options.compression = lua_toboolean(L, -1)
+            ? static_cast<uWS::CompressOptions>(uWS::SHARED_COMPRESSOR | uWS::SHARED_DECOMPRESSOR)
+            : uWS::DISABLED;
+    } else if (lua_isstring(L, -1)) {
+        const char *mode = lua_tostring(L, -1);
+        if (strcmp(mode, "disabled") == 0) {
+            options.compression = uWS::DISABLED;
+        } else if (strcmp(mode, "shared") == 0) {
+            options.compression = static_cast<uWS::CompressOptions>(uWS::SHARED_COMPRESSOR | uWS::SHARED_DECOMPRESSOR);
+        } else if (strcmp(mode, "dedicated") == 0) {
+            lua_getfield(L, opts, "compressorWindow");
+            int compressor_kb = lua_isnumber(L, -1) ? static_cast<int>(lua_tointeger(L, -1)) : 256;
+            lua_getfield(L, opts, "decompressorWindow");
+            int decompressor_kb = lua_isnumber(L, -1) ? static_cast<int>(lua_tointeger(L, -1)) : 32;
+            lua_pop(L, 2);
+            options.compression = static_cast<uWS::CompressOptions>(
+                dedicated_compressor(L, opts, compressor_kb) | dedicated_decompressor(L, opts, decompressor_kb));
+        } else {
+            luaL_argerror(L, opts, "compression must be \"disabled\", \"shared\" or \"dedicated\"");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, opts, "maxPayloadLength");
+    if (lua_isnumber(L, -1)) options.maxPayloadLength = static_cast<unsigned int>(lua_tointeger(L, -1));
+    lua_getfield(L, opts, "idleTimeout");
+    if (lua_isnumber(L, -1)) {
+        lua_Integer seconds = lua_tointeger(L, -1);
+        // uWS rejects timeouts between 1 and 8 seconds since pings are sent at that granularity
+        if (seconds != 0 && (seconds < 8 || seconds > 960)) {
+            luaL_argerror(L, opts, "idleTimeout must be 0 or between 8 and 960 seconds");
+        }
+        options.idleTimeout = static_cast<unsigned short>(seconds);
+    }
+    lua_getfield(L, opts, "maxBackpressure");
+    if (lua_isnumber(L, -1)) options.maxBackpressure = static_cast<unsigned int>(lua_tointeger(L, -1));
+    lua_getfield(L, opts, "closeOnBackpressureLimit");
+    if (lua_isboolean(L, -1)) options.closeOnBackpressureLimit = lua_toboolean(L, -1);
+    lua_getfield(L, opts, "resetIdleTimeoutOnSend");
+    if (lua_isboolean(L, -1)) options.resetIdleTimeoutOnSend = lua_toboolean(L, -1);
+    lua_getfield(L, opts, "sendPingsAutomatically");
+    if (lua_isboolean(L, -1)) options.sendPingsAutomatically = lua_toboolean(L, -1);
+    lua_getfield(L, opts, "maxLifetime");
+    if (lua_isnumber(L, -1)) options.maxLifetime = static_cast<unsigned short>(lua_tointeger(L, -1));
+    lua_pop(L, 7);
+
+    lua_getfield(L, opts, "batch");
+    if (lua_isboolean(L, -1)) {
+        options.batch = lua_toboolean(L, -1) ? WebSocketBatch::PER_CONNECTION : 0;
+    } else if (lua_isstring(L, -1)) {
+        const char *mode = lua_tostring(L, -1);
+        if (strcmp(mode, "connection") == 0) {
+            options.batch = WebSocketBatch::PER_CONNECTION;
+        } else if (strcmp(mode, "route") == 0) {
+            options.batch = WebSocketBatch::PER_ROUTE;
+        } else {
+            luaL_argerror(L, opts, "batch must be \"connection\" or \"route\"");
+        }
+    }
+    lua_getfield(L, opts, "batchMax");
+    if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) options.batchMax = static_cast<size_t>(lua_tointeger(L, -1));
+    lua_pop(L, 2);
+
+    return options;
+}
+
+// Lua Usage: app:ws_send(id_or_handle, message [, "text"|"binary" [, compress]]) -> ok, status, buffered
+// Same results as ws:send; false, "not found" when no live connection has that id or handle.
+int uw_ws_send(lua_State *L) {
+    int arg = first_arg_index(L);
+    auto *ws = check_registered_websocket(L, arg);
+    size_t len;
+    const char *message = luaL_checklstring(L, arg + 1, &len);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "not found");
+        return 2;
+    }
+    WebSocketUserData *data = ws->getUserData();
+    uWS::OpCode opcode = check_opcode(L, arg + 2, uWS::OpCode::TEXT);
+    bool compress = lua_isnoneornil(L, arg + 3) ? data->compress : lua_toboolean(L, arg + 3);
+
+    auto status = ws->send(std::string_view(message, len), opcode, compress);
+    push_send_status(L, status, ws->getBufferedAmount());
+    return 3;
+}
+
+// Lua Usage: app:ws_close(id_or_handle [, code [, reason]]) -> boolean
+// With a code the socket is closed with a close frame, otherwise it is closed immediately.
+int uw_ws_close(lua_State *L) {
+    int arg = first_arg_index(L);
+    auto *ws = check_registered_websocket(L, arg);
+    if (!ws) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    if (lua_isnumber(L, arg + 1)) {
+        size_t len = 0;
+        const char *reason = luaL_optlstring(L, arg + 2, "", &len);
+        ws->end(static_cast<int>(lua_tointeger(L, arg + 1)), std::string_view(reason, len));
+    } else {
+        ws->close();
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Lua Usage: app:ws_count() -> number of open connections on this app
+int uw_ws_count(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(websocket_registry.count));
+    return 1;
+}
+
+// Lua Usage: app:ws_each(function(ws, id, handle) ... end)
+// Visits every open connection. Sockets closed during the walk are skipped, and a
+// callback returning false stops it early.
+int uw_ws_each(lua_State *L) {
+    int arg = first_arg_index(L);
+    luaL_checktype(L, arg, LUA_TFUNCTION);
+
+    size_t end = websocket_registry.slots.size();
+    for (size_t slot = 0; slot < end && slot < websocket_registry.slots.size(); slot++) {
+        auto *ws = websocket_registry.slots[slot];
+        if (!ws) continue;
+        WebSocketUserData *data = ws->getUserData();
+
+        lua_pushvalue(L, arg);
+        push_websocket_userdata(L, ws);
+        lua_pushlstring(L, data->id.data(), data->id.size());
+        lua_pushinteger(L, data->handle);
+        lua_call(L, 3, 1);
+        bool stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (stop) break;
+    }
+    return 0;
+}
+
+// Expected usage: app.ws("/chat", function(ws, event, ...) end, {
+//     compression = "shared", maxPayloadLength = 64 * 1024, idleTimeout = 60,
+//     maxBackpressure = 1024 * 1024, closeOnBackpressureLimit = true,
+//     batch = "connection", batchMax = 1024 })
+int uw_ws(lua_State *L) {
+    int arg = first_arg_index(L);
+    const char *route_c_str = luaL_checkstring(L, arg);
+    std::string route = route_c_str; // Explicitly convert to std::string
+    luaL_checktype(L, arg + 1, LUA_TFUNCTION);
+    WebSocketOptions options = read_websocket_options(L, arg + 2);
+    lua_pushvalue(L, arg + 1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    int callback_id = callback_id_counter++;
+    lua_callbacks[callback_id] = ref;
 
-        .message = [callback_id](auto *ws, std::string_view message, uWS::OpCode opCode) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
+    WebSocketBatch *batch = options.batch ? create_websocket_batch(callback_id, options) : nullptr;
+
+    app->ws<WebSocketUserData>(route, {
+        .compression = options.compression,
+        .maxPayloadLength = options.maxPayloadLength,
+        .idleTimeout = options.idleTimeout,
+        .maxBackpressure = options.maxBackpressure,
+        .closeOnBackpressureLimit = options.closeOnBackpressureLimit,
+        .resetIdleTimeoutOnSend = options.resetIdleTimeoutOnSend,
+        .sendPingsAutomatically = options.sendPingsAutomatically,
+        .maxLifetime = options.maxLifetime,
+        .open = [callback_id, route, compress = options.compression != uWS::DISABLED](auto *ws) {
             lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
 
-            // Push Lua userdata
-            auto **ws_ud = static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(
-                lua_newuserdata(main_L, sizeof(*ws_ud)));
-            *ws_ud = ws;
-            luaL_getmetatable(main_L, "websocket");
-            lua_setmetatable(main_L, -2);
+            // Set WebSocket pointer in userdata
+            WebSocketUserData* data = ws->getUserData();
+            data->id_value = generate_unique_id_value();
+            data->id = format_unique_id(data->id_value);
+            data->socket = ws;
+            data->is_closed = false;
+            data->compress = compress;
+            websocket_registry.add(ws);
+
+            // Create the connection's Lua userdata once
+            create_websocket_userdata(main_L, ws);
+
+            lua_pushstring(main_L, "open");
+
+            if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
+                std::cerr << "Lua error (open): " << lua_tostring(main_L, -1) << std::endl;
+                lua_pop(main_L, 1);
+            }
+        },
+
+        .message = [callback_id, batch](auto *ws, std::string_view message, uWS::OpCode opCode) {
+            if (batch) {
+                batch->sockets.push_back(ws);
+                batch->messages.emplace_back(message);
+                batch->opcodes.push_back(opCode);
+                if (batch->messages.size() >= batch->max_messages) {
+                    flush_websocket_batch(*batch);
+                }
+                return;
+            }
+
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+            push_websocket_userdata(main_L, ws);
 
             lua_pushstring(main_L, "message");
             lua_pushlstring(main_L, message.data(), message.size());
@@ -901,6 +2324,20 @@ int uw_ws(lua_State *L) {
             }
         },
 
+        // Backpressure went down after a send returned "backpressure"; producers can resume
+        .drain = [callback_id](auto *ws) {
+            lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
+            push_websocket_userdata(main_L, ws);
+
+            lua_pushstring(main_L, "drain");
+            lua_pushinteger(main_L, ws->getBufferedAmount());
+
+            if (lua_pcall(main_L, 3, 0, 0) != LUA_OK) {
+                std::cerr << "Lua error (drain): " << lua_tostring(main_L, -1) << std::endl;
+                lua_pop(main_L, 1);
+            }
+        },
+
         // .close = [callback_id](auto *ws, int code, std::string_view message) {
         //     std::lock_guard<std::mutex> lock(lua_mutex);
         //     WebSocketUserData* data = ws->getUserData();
@@ -927,22 +2364,30 @@ int uw_ws(lua_State *L) {
         //     }
         // }
         // Modify the close handler in uw_ws
-        .close = [callback_id](auto *ws, int code, std::string_view message) {
-    std::lock_guard<std::mutex> lock(lua_mutex);
-    WebSocketUserData* data = ws ? ws->getUserData() : nullptr;
-    std::string id;
-    
-    if (data) {
-        data->is_closed = true;
-        data->socket = nullptr;
-        id = data->id;
+        .close = [callback_id, batch](auto *ws, int code, std::string_view message) {
+    // Messages still batched for this socket are delivered before its close event
+    if (batch) {
+        if (batch->flushing) {
+            batch->closed.insert(ws);
+        } else {
+            flush_websocket_batch(*batch);
+        }
     }
 
+    WebSocketUserData* data = ws->getUserData();
+    data->is_closed = true;
+    data->socket = nullptr;
+    websocket_registry.remove(ws);
+
     lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_callbacks[callback_id]);
-    
-    // Create zombie userdata with the ID
-    create_zombie_websocket(main_L, id);
-    
+
+    // Same userdata as every other event, now a zombie: the pointer is cleared so
+    // references kept in Lua fail safely, and the id stays readable
+    push_websocket_userdata(main_L, ws);
+    *static_cast<uWS::WebSocket<false, true, WebSocketUserData>**>(lua_touserdata(main_L, -1)) = nullptr;
+    luaL_unref(main_L, LUA_REGISTRYINDEX, data->lua_ref);
+    data->lua_ref = LUA_NOREF;
+
     lua_pushstring(main_L, "close");
     lua_pushinteger(main_L, code);
     lua_pushlstring(main_L, message.data(), message.size());
@@ -998,7 +2443,18 @@ namespace {
     const size_t SMALL_FILE_THRESHOLD = 64 * 1024; // 64KB
     const size_t LARGE_FILE_CHUNK_SIZE = 128 * 1024; // 128KB
     const size_t MMAP_THRESHOLD = 10 * 1024 * 1024; // 10MB
-    const unsigned int TRANSFER_TIMEOUT_MS = 30000; // 30 seconds
+    const unsigned int TRANSFER_TIMEOUT_MS = 30000; // 30 seconds without progress aborts a transfer
+    const size_t STREAM_MAX_BUFFERED = 256 * 1024; // Above this, chunked streams only top up in small slices
+    const size_t STREAM_DRAIN_SLICE = 4 * 1024;
+    const size_t STATIC_CACHE_BYTES = 64 * 1024 * 1024; // 64MB per serve_static mount
+    const size_t STATIC_CACHE_MAX_FILE = 1024 * 1024; // 1MB
+    const unsigned int STATIC_CACHE_REVALIDATE_MS = 1000; // stat() a cached file at most once a second
+    const size_t GZIP_MIN_SIZE = 256; // Smaller bodies rarely shrink enough to be worth a Content-Encoding
+    const int GZIP_LEVEL = 6;
+    const size_t MAX_BYTE_RANGES = 16; // More ranges than this is answered with the full file
+    const size_t SENDFILE_BURST_BYTES = 4 * 1024 * 1024; // Per writable event, so one fast client can't starve the loop
+    const size_t SENDFILE_COPY_CHUNK = 16 * 1024; // Copied through uWS when it holds backpressure, and for the tail
+    const unsigned int SENDFILE_IDLE_TIMEOUT_S = 10; // Same as uWS's HTTP idle timeout
 }
 
 // Memory-mapped file wrapper
@@ -1039,385 +2495,2151 @@ public:
     size_t getSize() const { return size; }
 };
 
-// Helper function to clean path and prevent directory traversal
-std::string sanitize_path(const std::string& base, const std::string& path) {
-    fs::path full_path = fs::path(base) / path;
-    full_path = fs::canonical(full_path);
-    
-    // Verify the path is within the base directory
-    fs::path base_path = fs::canonical(base);
-    if (full_path.string().rfind(base_path.string(), 0) != 0) {
-        throw std::runtime_error("Directory traversal attempt detected");
-    }
-    
-    return full_path.string();
-}
+// --- Byte ranges (RFC 7233) ---
 
-// Enhanced static file serving function with proper completion handling
-int uw_serve_static(lua_State *L) {
-    const char *route_prefix = luaL_checkstring(L, 1);
-    const char *dir_path = luaL_checkstring(L, 2);
+struct ByteRange {
+    size_t first;
+    size_t last; // Inclusive
+};
 
-    if (!fs::is_directory(dir_path)) {
-        std::cerr << "ERROR: Static file directory '" << dir_path 
-                  << "' does not exist or is not a directory." << std::endl;
-        lua_pushboolean(L, 0);
-        return 1;
-    }
+enum class RangeResult { Ignore, Satisfiable, Unsatisfiable };
 
-    std::string route_pattern = std::string(route_prefix) + "/*";
+static bool parse_size(std::string_view digits, size_t& value) {
+    if (digits.empty()) return false;
+    value = 0;
+    for (char c : digits) {
+        if (c < '0' || c > '9') return false;
+        size_t next = value * 10 + static_cast<size_t>(c - '0');
+        if (next < value) return false; // Overflow
+        value = next;
+    }
+    return true;
+}
 
-    app->get(route_pattern.c_str(), [dir_path_str = std::string(dir_path), 
-                                   route_prefix_str = std::string(route_prefix)](auto *res, auto *req) {
-        try {
-            std::string_view url = req->getUrl();
-            std::string file_path_suffix = std::string(url.substr(route_prefix_str.length()));
-            
-            // Remove leading slash if present
-            if (!file_path_suffix.empty() && file_path_suffix[0] == '/') {
-                file_path_suffix.erase(0, 1);
+// Parses "bytes=0-99,200-,-500" against `size`. Overlapping and adjacent ranges are
+// merged; malformed headers and abusive range counts are ignored (full 200 response).
+static RangeResult parse_range_header(std::string_view header, size_t size, std::vector<ByteRange>& ranges) {
+    ranges.clear();
+    if (header.substr(0, 6) != "bytes=") return RangeResult::Ignore;
+    header.remove_prefix(6);
+
+    size_t specs = 0;
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view spec = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+        while (!spec.empty() && spec.front() == ' ') spec.remove_prefix(1);
+        while (!spec.empty() && spec.back() == ' ') spec.remove_suffix(1);
+        if (spec.empty()) continue;
+        if (++specs > MAX_BYTE_RANGES) return RangeResult::Ignore;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) return RangeResult::Ignore;
+        std::string_view first_str = spec.substr(0, dash);
+        std::string_view last_str = spec.substr(dash + 1);
+
+        size_t first, last;
+        if (first_str.empty()) {
+            // Suffix range: the final N bytes
+            size_t suffix;
+            if (!parse_size(last_str, suffix)) return RangeResult::Ignore;
+            if (suffix == 0 || size == 0) continue;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            if (!parse_size(first_str, first)) return RangeResult::Ignore;
+            if (last_str.empty()) {
+                last = size - 1;
+            } else {
+                if (!parse_size(last_str, last) || last < first) return RangeResult::Ignore;
+                last = std::min(last, size - 1);
             }
+            if (first >= size) continue;
+        }
+        ranges.push_back({first, last});
+    }
 
-            // Handle directory requests by appending index.html
-            fs::path full_path;
-            try {
-                full_path = sanitize_path(dir_path_str, file_path_suffix);
-                if (fs::is_directory(full_path)) {
-                    full_path /= "index.html";
-                }
-            } catch (const std::exception& e) {
-                std::cerr << "SECURITY: " << e.what() << " for path: " << file_path_suffix << std::endl;
-                res->writeStatus("403 Forbidden")->end("Forbidden");
-                return;
-            }
+    if (specs == 0) return RangeResult::Ignore;
+    if (ranges.empty()) return RangeResult::Unsatisfiable;
 
-            // Check if file exists and is regular file
-            if (!fs::exists(full_path) || !fs::is_regular_file(full_path)) {
-                res->writeStatus("404 Not Found")->end("Not Found");
-                return;
-            }
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b) {
+        return a.first < b.first;
+    });
+    std::vector<ByteRange> merged;
+    for (const ByteRange& range : ranges) {
+        if (!merged.empty() && range.first <= merged.back().last + 1) {
+            merged.back().last = std::max(merged.back().last, range.last);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    ranges.swap(merged);
+    return RangeResult::Satisfiable;
+}
 
-            // Get file size
-            size_t file_size = fs::file_size(full_path);
+// --- Backpressure-aware response streaming ---
+// Bodies are pulled from a reader only as fast as the socket takes them. With a known
+// length they are written with tryEnd: uWS emits Content-Length, never buffers body
+// bytes, and an unacknowledged chunk is retried from getWriteOffset(). Without one they
+// are sent chunked with write(); uWS only drains its buffer when we write, so every
+// writable event writes, but in small slices once more than max_buffered is held.
+
+// Sets `chunk` to the next part of the body (at most `max` bytes). The viewed bytes must
+// stay valid until the next call. An empty chunk ends the body; false aborts the response.
+using StreamReader = uWS::MoveOnlyFunction<bool(std::string_view& chunk, size_t max)>;
+
+struct ResponseStream {
+    StreamReader reader;
+    bool known_length = false;
+    uintmax_t total = 0;
+    size_t chunk_size = LARGE_FILE_CHUNK_SIZE;
+    size_t max_buffered = STREAM_MAX_BUFFERED;
+    std::string_view pending;     // Chunk not yet acknowledged by tryEnd
+    uintmax_t pending_offset = 0; // Body offset at which `pending` starts
+    std::string label;            // For log messages
+};
 
-            // Set headers
-            std::string mime_type = get_mime_type(full_path.string());
-            res->writeHeader("Content-Type", mime_type);
-            res->writeHeader("Content-Length", std::to_string(file_size));
-            
-            // For small files, send everything at once
-            if (file_size <= SMALL_FILE_THRESHOLD) {
-                std::ifstream file(full_path, std::ios::binary);
-                if (!file) {
-                    std::cerr << "ERROR: Failed to open small file: " << full_path.string() << std::endl;
-                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                    return;
+// Writes until the body is done or the socket is full; returns false while waiting for writability
+static bool pump_stream(uWS::HttpResponse<false> *res, ResponseStream& stream) {
+    if (stream.known_length) {
+        while (true) {
+            uintmax_t offset = res->getWriteOffset();
+            if (offset >= stream.pending_offset + stream.pending.size()) {
+                size_t max = static_cast<size_t>(std::min<uintmax_t>(stream.chunk_size, stream.total - offset));
+                stream.pending_offset = offset;
+                if (max > 0 && (!stream.reader(stream.pending, max) || stream.pending.empty())) {
+                    // Content-Length is already on the wire, so a short body can only be cut off
+                    std::cerr << "ERROR: Stream ended early for " << stream.label << std::endl;
+                    res->close();
+                    return true;
                 }
-
-                std::vector<char> buffer(file_size);
-                if (!file.read(buffer.data(), file_size)) {
-                    std::cerr << "ERROR: Failed to read small file: " << full_path.string() << std::endl;
-                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                    return;
+                if (stream.pending.size() > max) {
+                    // Readers must respect max; dropping the excess would leave a hole in the body
+                    std::cerr << "ERROR: Stream reader overran the body for " << stream.label << std::endl;
+                    res->close();
+                    return true;
                 }
-                res->end(std::string_view(buffer.data(), file_size));
-                return;
             }
 
-            // For medium files, use buffered chunked transfer
-            if (file_size <= MMAP_THRESHOLD) {
-                auto file_stream_ptr = std::make_shared<std::ifstream>(
-                    full_path, std::ios::binary
-                );
-                
-                if (!file_stream_ptr->is_open()) {
-                    std::cerr << "ERROR: Could not open medium file: " << full_path.string() << std::endl;
-                    res->writeStatus("500 Internal Server Error")->end("Could not open file");
-                    return;
-                }
+            auto [ok, done] = res->tryEnd(stream.pending.substr(static_cast<size_t>(offset - stream.pending_offset)), stream.total);
+            if (done) return true;
+            if (!ok) return false;
+        }
+    }
 
-                auto buffer_ptr = std::make_shared<std::vector<char>>(LARGE_FILE_CHUNK_SIZE);
-                auto remaining_bytes = std::make_shared<size_t>(file_size);
-                auto transfer_start = std::chrono::steady_clock::now();
+    bool drained = true;
+    while (drained) {
+        size_t max = res->getBufferedAmount() >= stream.max_buffered ? STREAM_DRAIN_SLICE : stream.chunk_size;
+        std::string_view chunk;
+        if (!stream.reader(chunk, max)) {
+            std::cerr << "ERROR: Stream failed for " << stream.label << std::endl;
+            res->close();
+            return true;
+        }
+        if (chunk.empty()) {
+            res->end();
+            return true;
+        }
+        drained = res->write(chunk);
+    }
+    return false;
+}
 
-                // Abort handler
-                res->onAborted([file_stream_ptr, full_path_str = full_path.string()]() {
-                    std::cerr << "WARNING: Transfer aborted for file: " << full_path_str << std::endl;
-                });
+// Starts streaming a response body; headers written beforehand are kept. The stream
+// owns the reader until the body is complete or the client goes away.
+static void start_stream(uWS::HttpResponse<false> *res, std::shared_ptr<ResponseStream> stream) {
+    if (pump_stream(res, *stream)) {
+        detach_async_response(res);
+        return;
+    }
 
-                // Chunked transfer handler
-                res->onWritable([res, file_stream_ptr, buffer_ptr, remaining_bytes, 
-                                transfer_start, full_path_str = full_path.string()](int /* offset */) mutable {
-                    // Check timeout
-                    auto now = std::chrono::steady_clock::now();
-                    if (std::chrono::duration_cast<std::chrono::milliseconds>(
-                        now - transfer_start).count() > TRANSFER_TIMEOUT_MS) {
-                        std::cerr << "ERROR: Transfer timeout reached for file: " << full_path_str << std::endl;
-                        res->writeStatus("500 Internal Server Error")->end("Transfer Timeout");
-                        return true;
-                    }
+    unsigned int idle_timeout_s = TRANSFER_TIMEOUT_MS / 1000;
+    us_socket_timeout(0, reinterpret_cast<us_socket_t*>(res), idle_timeout_s);
+    res->onWritable([res, stream, idle_timeout_s](uintmax_t /* offset */) {
+        if (pump_stream(res, *stream)) {
+            detach_async_response(res);
+            return true;
+        }
+        // uWS suspends the idle timeout while writable; a client that stops reading is cut off
+        us_socket_timeout(0, reinterpret_cast<us_socket_t*>(res), idle_timeout_s);
+        return false;
+    });
+    res->onAborted([res, stream]() {
+        std::cerr << "WARNING: Transfer aborted for " << stream->label << std::endl;
+        stream->reader = nullptr;
+        // This replaced the abort handler of an async route, if any
+        cancel_async_response(res);
+    });
+}
 
-                    if (*remaining_bytes == 0) {
-                        // All data sent - end the response
-                        res->end();
-                        return true;
-                    }
+// Reader over a file read sequentially with a reusable buffer
+static StreamReader make_file_reader(std::shared_ptr<std::ifstream> file, size_t chunk_size) {
+    auto buffer = std::make_shared<std::vector<char>>(chunk_size);
+    return [file, buffer](std::string_view& chunk, size_t max) {
+        if (buffer->size() < max) buffer->resize(max);
+        file->read(buffer->data(), static_cast<std::streamsize>(max));
+        std::streamsize got = file->gcount();
+        if (got <= 0 && !file->eof()) return false;
+        chunk = std::string_view(buffer->data(), static_cast<size_t>(got));
+        return true;
+    };
+}
 
-                    size_t chunk_size = std::min(buffer_ptr->size(), *remaining_bytes);
-                    if (!file_stream_ptr->read(buffer_ptr->data(), chunk_size)) {
-                        std::cerr << "ERROR: Failed to read chunk from file: " << full_path_str << std::endl;
-                        res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                        return true;
-                    }
+// Reader handing out consecutive views of a mapping; nothing is copied
+static StreamReader make_mapped_reader(std::shared_ptr<MappedFile> file) {
+    auto position = std::make_shared<size_t>(0);
+    return [file, position](std::string_view& chunk, size_t max) {
+        size_t len = std::min(max, file->getSize() - *position);
+        chunk = std::string_view(file->getData() + *position, len);
+        *position += len;
+        return true;
+    };
+}
 
-                    bool write_success = res->write(std::string_view(buffer_ptr->data(), chunk_size));
-                    *remaining_bytes -= chunk_size;
+// Body of a multipart/byteranges response: preambles plus slices of a mapping
+struct SpanBody {
+    std::shared_ptr<MappedFile> file;
+    std::vector<std::string> owned; // Storage for multipart preambles
+    std::vector<std::string_view> spans;
+    size_t index = 0;
+    size_t position = 0; // Within spans[index]
+};
 
-                    if (!write_success) {
-                        std::cerr << "WARNING: Write failed for file: " << full_path_str << std::endl;
-                        return true;
-                    }
+static StreamReader make_span_reader(std::shared_ptr<SpanBody> body) {
+    return [body](std::string_view& chunk, size_t max) {
+        while (body->index < body->spans.size() && body->position == body->spans[body->index].size()) {
+            body->index++;
+            body->position = 0;
+        }
+        if (body->index == body->spans.size()) {
+            chunk = std::string_view();
+            return true;
+        }
+        chunk = body->spans[body->index].substr(body->position, max);
+        body->position += chunk.size();
+        return true;
+    };
+}
 
-                    // Return true if we're done, false if more to send
-                    return *remaining_bytes == 0;
-                });
+// Keeps a Lua reader function alive for as long as its stream exists
+struct LuaStreamReader {
+    int ref = LUA_NOREF;
+    std::string chunk; // Copy of the last returned string; the Lua value may be collected
+    size_t offset = 0; // Start of the part of chunk not yet handed out
 
-                // Send first chunk
-                size_t first_chunk = std::min(buffer_ptr->size(), file_size);
-                if (first_chunk > 0) {
-                    if (!file_stream_ptr->read(buffer_ptr->data(), first_chunk)) {
-                        std::cerr << "ERROR: Failed to read first chunk from file: " << full_path.string() << std::endl;
-                        res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                        return;
-                    }
-                    res->write(std::string_view(buffer_ptr->data(), first_chunk));
-                }
-            }
-            // For very large files (above MMAP_THRESHOLD), use memory-mapped I/O
-            else {
-                try {
-                    auto mapped_file = std::make_shared<MappedFile>(full_path.string());
-                    auto remaining_bytes = std::make_shared<size_t>(mapped_file->getSize());
-                    auto transfer_start = std::chrono::steady_clock::now();
+    ~LuaStreamReader() {
+        if (main_L) luaL_unref(main_L, LUA_REGISTRYINDEX, ref);
+    }
+};
 
-                    // Abort handler
-                    res->onAborted([mapped_file, full_path_str = full_path.string()]() {
-                        std::cerr << "WARNING: Transfer aborted for file: " << full_path_str << std::endl;
-                    });
+// Lua Usage: res:stream(function(max_bytes) return next_chunk_or_nil end [, total_size [, chunk_size]])
+// The reader is called whenever the socket can take more. Returning nil (or "") ends the
+// body; raising an error closes the connection. With total_size the response carries a
+// Content-Length and the reader must produce exactly that many bytes, otherwise it is chunked.
+static int res_stream(lua_State *L) {
+    uWS::HttpResponse<false>** res = check_res(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
 
-                    // Chunked transfer handler using memory-mapped file
-                    res->onWritable([res, mapped_file, remaining_bytes, 
-                                    transfer_start, full_path_str = full_path.string()](int /* offset */) mutable {
-                        // Check timeout
-                        auto now = std::chrono::steady_clock::now();
-                        if (std::chrono::duration_cast<std::chrono::milliseconds>(
-                            now - transfer_start).count() > TRANSFER_TIMEOUT_MS) {
-                            std::cerr << "ERROR: Transfer timeout reached for file: " << full_path_str << std::endl;
-                            res->writeStatus("500 Internal Server Error")->end("Transfer Timeout");
-                            return true;
-                        }
+    auto stream = std::make_shared<ResponseStream>();
+    if (lua_isnumber(L, 3)) {
+        stream->known_length = true;
+        stream->total = static_cast<uintmax_t>(lua_tonumber(L, 3));
+    }
+    if (lua_isnumber(L, 4) && lua_tointeger(L, 4) > 0) {
+        stream->chunk_size = static_cast<size_t>(lua_tointeger(L, 4));
+    }
+    stream->label = "Lua stream";
 
-                        if (*remaining_bytes == 0) {
-                            // All data sent - end the response
-                            res->end();
-                            return true;
-                        }
+    auto lua_reader = std::make_shared<LuaStreamReader>();
+    lua_pushvalue(L, 2);
+    lua_reader->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // A string longer than max is handed out over several calls before Lua is asked again
+    stream->reader = [lua_reader](std::string_view& chunk, size_t max) {
+        if (lua_reader->offset < lua_reader->chunk.size()) {
+            chunk = std::string_view(lua_reader->chunk).substr(lua_reader->offset, max);
+            lua_reader->offset += chunk.size();
+            return true;
+        }
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, lua_reader->ref);
+        lua_pushinteger(main_L, static_cast<lua_Integer>(max));
+        if (lua_pcall(main_L, 1, 1, 0) != LUA_OK) {
+            std::cerr << "Lua error in stream reader: " << lua_tostring(main_L, -1) << std::endl;
+            lua_pop(main_L, 1);
+            return false;
+        }
+        size_t len = 0;
+        const char *data = lua_isstring(main_L, -1) ? lua_tolstring(main_L, -1, &len) : nullptr;
+        lua_reader->chunk.assign(data ? data : "", len);
+        lua_pop(main_L, 1);
+        chunk = std::string_view(lua_reader->chunk).substr(0, max);
+        lua_reader->offset = chunk.size();
+        return true;
+    };
 
-                        size_t chunk_size = std::min(LARGE_FILE_CHUNK_SIZE, *remaining_bytes);
-                        const char* chunk_start = mapped_file->getData() + (mapped_file->getSize() - *remaining_bytes);
+    start_stream(*res, std::move(stream));
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-                        bool write_success = res->write(std::string_view(chunk_start, chunk_size));
-                        *remaining_bytes -= chunk_size;
+static std::string make_multipart_boundary() {
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    char buf[40];
+    int len = snprintf(buf, sizeof(buf), "uws_lua_%016llx", static_cast<unsigned long long>(rng()));
+    return std::string(buf, len);
+}
 
-                        if (!write_success) {
-                            std::cerr << "WARNING: Write failed for file: " << full_path_str << std::endl;
-                            return true;
-                        }
+static std::string content_range(const ByteRange& range, size_t size) {
+    return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(size);
+}
 
-                        // Return true if we're done, false if more to send
-                        return *remaining_bytes == 0;
-                    });
+// Body of a 206 Partial Content from a mapped file: a single slice, or multipart/byteranges.
+// The caller has already written the status line and the representation headers.
+static void send_byte_ranges(uWS::HttpResponse<false> *res, std::shared_ptr<MappedFile> file,
+                             const std::vector<ByteRange>& ranges, const std::string& mime_type) {
+    auto body = std::make_shared<SpanBody>();
+    body->file = file;
+    size_t size = file->getSize();
+
+    if (ranges.size() == 1) {
+        const ByteRange& range = ranges.front();
+        res->writeHeader("Content-Type", mime_type);
+        res->writeHeader("Content-Range", content_range(range, size));
+        body->spans.emplace_back(file->getData() + range.first, range.last - range.first + 1);
+    } else {
+        std::string boundary = make_multipart_boundary();
+        res->writeHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+
+        body->owned.reserve(ranges.size() + 1);
+        for (const ByteRange& range : ranges) {
+            body->owned.push_back("\r\n--" + boundary + "\r\nContent-Type: " + mime_type
+                                  + "\r\nContent-Range: " + content_range(range, size) + "\r\n\r\n");
+            body->spans.emplace_back(body->owned.back());
+            body->spans.emplace_back(file->getData() + range.first, range.last - range.first + 1);
+        }
+        body->owned.push_back("\r\n--" + boundary + "--\r\n");
+        body->spans.emplace_back(body->owned.back());
+    }
+
+    auto stream = std::make_shared<ResponseStream>();
+    stream->known_length = true;
+    for (std::string_view span : body->spans) stream->total += span.size();
+    stream->reader = make_span_reader(std::move(body));
+    stream->label = "byte ranges";
+    start_stream(res, std::move(stream));
+}
+
+#ifdef __linux__
+// --- Zero-copy static file transfer (sendfile) ---
+// uWS keeps owning the status line, headers and response lifecycle: tryEnd({}, size)
+// emits the headers with Content-Length, sendfile() moves the body straight from the
+// page cache to the socket and advances uWS's offset with overrideWriteOffset(), and
+// the final byte is sent through tryEnd so uWS completes the response itself. Should
+// uWS ever hold buffered bytes, the next chunk is copied through tryEnd to drain them.
+struct SendfileTransfer {
+    int file_fd = -1;
+    int sock_fd = -1;
+    uintmax_t total = 0;
+    std::string path;
+    std::vector<char> copy_buffer;
+
+    ~SendfileTransfer() {
+        if (file_fd != -1) close(file_fd);
+    }
+};
+
+// uSockets drops writable interest after on_writable unless one of its own writes
+// failed, and sendfile's EAGAIN is invisible to it, so these sockets are re-armed
+// once the loop iteration has finished dispatching
+static thread_local std::unordered_set<uWS::HttpResponse<false>*> sendfile_rearm;
+static thread_local bool sendfile_rearm_registered = false;
+
+static void rearm_writable(uWS::HttpResponse<false> *res) {
+    if (!sendfile_rearm_registered) {
+        uWS::Loop::get()->addPostHandler(&sendfile_rearm, [](uWS::Loop *loop) {
+            for (uWS::HttpResponse<false> *pending : sendfile_rearm) {
+                us_poll_change(reinterpret_cast<us_poll_t*>(pending), reinterpret_cast<us_loop_t*>(loop),
+                               LIBUS_SOCKET_READABLE | LIBUS_SOCKET_WRITABLE);
+            }
+            sendfile_rearm.clear();
+        });
+        sendfile_rearm_registered = true;
+    }
+    sendfile_rearm.insert(res);
+}
+
+// Moves as much of the body as the socket takes; returns false while waiting for writability
+static bool pump_sendfile(uWS::HttpResponse<false> *res, SendfileTransfer& transfer) {
+    size_t burst = 0;
+    while (true) {
+        uintmax_t offset = res->getWriteOffset();
+        uintmax_t remaining = transfer.total - offset;
+        if (remaining == 0) return true;
+
+        if (res->getBufferedAmount() > 0 || remaining == 1) {
+            size_t len = remaining == 1 ? 1 : static_cast<size_t>(std::min<uintmax_t>(SENDFILE_COPY_CHUNK, remaining - 1));
+            transfer.copy_buffer.resize(len);
+            ssize_t got = pread(transfer.file_fd, transfer.copy_buffer.data(), len, static_cast<off_t>(offset));
+            if (got <= 0) {
+                std::cerr << "ERROR: Failed to read file: " << transfer.path << std::endl;
+                res->close();
+                return true;
+            }
+            auto [ok, done] = res->tryEnd(std::string_view(transfer.copy_buffer.data(), static_cast<size_t>(got)), transfer.total);
+            if (done) return true;
+            if (!ok) return false; // uWS polls for writable itself after a failed write
+            continue;
+        }
+
+        if (burst >= SENDFILE_BURST_BYTES) {
+            rearm_writable(res);
+            return true;
+        }
+
+        // The last byte is left for tryEnd
+        off_t file_offset = static_cast<off_t>(offset);
+        size_t count = static_cast<size_t>(std::min<uintmax_t>(remaining - 1, SENDFILE_BURST_BYTES - burst));
+        ssize_t sent = sendfile(transfer.sock_fd, transfer.file_fd, &file_offset, count);
+        if (sent > 0) {
+            res->overrideWriteOffset(offset + static_cast<uintmax_t>(sent));
+            burst += static_cast<size_t>(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            us_socket_timeout(0, reinterpret_cast<us_socket_t*>(res), SENDFILE_IDLE_TIMEOUT_S);
+            rearm_writable(res);
+            return false;
+        }
+
+        std::cerr << "ERROR: sendfile failed for file " << transfer.path << ": "
+                  << (sent == 0 ? "file truncated" : strerror(errno)) << std::endl;
+        res->close();
+        return true;
+    }
+}
+
+// Starts a sendfile transfer for a response whose other headers are already written.
+// Returns false (nothing written) if the file can't be opened, so the caller can fall back.
+static bool start_sendfile(uWS::HttpResponse<false> *res, const std::string& path, size_t file_size) {
+    int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) return false;
+
+    auto transfer = std::make_shared<SendfileTransfer>();
+    transfer->file_fd = file_fd;
+    transfer->sock_fd = static_cast<int>(reinterpret_cast<uintptr_t>(res->getNativeHandle()));
+    transfer->total = file_size;
+    transfer->path = path;
+
+    // Headers go into the cork buffer now; the body starts on the first writable
+    // event, after uWS has flushed them
+    res->tryEnd(std::string_view(), file_size);
+    res->onWritable([res, transfer](uintmax_t /* offset */) {
+        return pump_sendfile(res, *transfer);
+    });
+    res->onAborted([res, transfer]() {
+        sendfile_rearm.erase(res);
+    });
+    rearm_writable(res);
+    return true;
+}
+#endif
+
+// Helper function to clean path and prevent directory traversal
+std::string sanitize_path(const std::string& base, const std::string& path) {
+    fs::path full_path = fs::path(base) / path;
+    full_path = fs::canonical(full_path);
+    
+    // Verify the path is within the base directory
+    fs::path base_path = fs::canonical(base);
+    if (full_path.string().rfind(base_path.string(), 0) != 0) {
+        throw std::runtime_error("Directory traversal attempt detected");
+    }
+    
+    return full_path.string();
+}
+
+// --- Static file validators (ETag / Last-Modified) ---
+
+// RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+static std::string format_http_date(time_t t) {
+    struct tm tm_utc;
+    gmtime_r(&t, &tm_utc);
+    char buf[64];
+    size_t len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    return std::string(buf, len);
+}
+
+// Returns -1 when the header is not an IMF-fixdate
+static time_t parse_http_date(std::string_view value) {
+    std::string str(value);
+    struct tm tm_utc;
+    memset(&tm_utc, 0, sizeof(tm_utc));
+    const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    if (!end) return -1;
+    return timegm(&tm_utc);
+}
+
+// Strong validator from size and nanosecond mtime; changes whenever the file is rewritten
+static std::string make_etag(const struct stat& st) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "\"%llx-%llx%09lx\"",
+                       static_cast<unsigned long long>(st.st_size),
+                       static_cast<unsigned long long>(st.st_mtim.tv_sec),
+                       static_cast<unsigned long>(st.st_mtim.tv_nsec));
+    return std::string(buf, len);
+}
+
+// If-None-Match is a comma separated list of (possibly weak) tags, or "*"
+static bool etag_list_matches(std::string_view header, std::string_view etag) {
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view candidate = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+        while (!candidate.empty() && (candidate.front() == ' ' || candidate.front() == '\t')) candidate.remove_prefix(1);
+        while (!candidate.empty() && (candidate.back() == ' ' || candidate.back() == '\t')) candidate.remove_suffix(1);
+        if (candidate.substr(0, 2) == "W/") candidate.remove_prefix(2);
+
+        if (candidate == "*" || candidate == etag) return true;
+    }
+    return false;
+}
+
+// RFC 7232: If-None-Match takes precedence, If-Modified-Since is only used without it
+static bool is_not_modified(std::string_view if_none_match, std::string_view if_modified_since,
+                            std::string_view etag, time_t mtime) {
+    if (!if_none_match.empty()) {
+        return etag_list_matches(if_none_match, etag);
+    }
+    if (!if_modified_since.empty()) {
+        time_t since = parse_http_date(if_modified_since);
+        return since != -1 && mtime <= since;
+    }
+    return false;
+}
+
+static bool is_not_modified(uWS::HttpRequest *req, std::string_view etag, time_t mtime) {
+    return is_not_modified(req->getHeader("if-none-match"), req->getHeader("if-modified-since"), etag, mtime);
+}
+
+// has_variants: the 200 would carry "Vary: Accept-Encoding", so the 304 repeats it
+static void send_not_modified(uWS::HttpResponse<false> *res, std::string_view etag, std::string_view last_modified,
+                              bool has_variants) {
+    res->writeStatus("304 Not Modified");
+    res->writeHeader("ETag", etag);
+    res->writeHeader("Last-Modified", last_modified);
+    if (has_variants) {
+        res->writeHeader("Vary", "Accept-Encoding");
+    }
+    res->endWithoutBody();
+}
+
+// --- In-memory static file cache ---
+// LRU of file bytes plus their precomputed response headers, bounded by a byte budget.
+// Keys are the request path relative to the mount, so a hit skips path sanitizing and
+// every filesystem call. Entries are revalidated with one stat() at most every
+// revalidate_ms and dropped when size or mtime changed.
+class StaticFileCache {
+public:
+    struct Entry {
+        std::string path;
+        std::string body;
+        std::string br_body;   // Precompressed sibling (<file>.br), empty when absent
+        std::string gzip_body; // Precompressed sibling (<file>.gz) or compressed on load
+        bool gzip_on_demand = false; // Uncached entry that is gzipped only when a 200 needs it
+        std::string content_type;
+        std::string etag;
+        std::string last_modified;
+        time_t mtime = 0;
+        off_t size = 0;
+        long mtime_nsec = 0;
+        std::chrono::steady_clock::time_point validated;
+
+        size_t bytes() const { return body.size() + br_body.size() + gzip_body.size(); }
+    };
+
+    StaticFileCache(size_t max_bytes, size_t max_file_size, std::chrono::milliseconds revalidate)
+        : max_bytes(max_bytes), max_file_size(max_file_size), revalidate(revalidate) {}
+
+    bool cacheable(size_t file_size) const {
+        return file_size <= max_file_size && file_size <= max_bytes;
+    }
+
+    // Fresh entry for `key`, or nullptr on a miss or when the file changed on disk
+    std::shared_ptr<Entry> get(const std::string& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) return nullptr;
+
+        std::shared_ptr<Entry> entry = it->second.first;
+        auto now = std::chrono::steady_clock::now();
+        if (now - entry->validated >= revalidate) {
+            struct stat st;
+            if (stat(entry->path.c_str(), &st) != 0 || st.st_size != entry->size
+                || st.st_mtim.tv_sec != entry->mtime || st.st_mtim.tv_nsec != entry->mtime_nsec) {
+                erase(it);
+                return nullptr;
+            }
+            entry->validated = now;
+        }
+
+        lru.splice(lru.begin(), lru, it->second.second);
+        return entry;
+    }
+
+    void put(const std::string& key, std::shared_ptr<Entry> entry) {
+        if (!cacheable(entry->body.size()) || entry->bytes() > max_bytes) return;
+
+        auto it = entries.find(key);
+        if (it != entries.end()) erase(it);
+
+        lru.push_front(key);
+        used_bytes += entry->bytes();
+        entries.emplace(key, std::make_pair(std::move(entry), lru.begin()));
+
+        while (used_bytes > max_bytes && !lru.empty()) {
+            erase(entries.find(lru.back()));
+        }
+    }
+
+private:
+    using Map = std::unordered_map<std::string, std::pair<std::shared_ptr<Entry>, std::list<std::string>::iterator>>;
+
+    void erase(Map::iterator it) {
+        used_bytes -= it->second.first->bytes();
+        lru.erase(it->second.second);
+        entries.erase(it);
+    }
+
+    size_t max_bytes;
+    size_t max_file_size;
+    std::chrono::milliseconds revalidate;
+    size_t used_bytes = 0;
+    std::list<std::string> lru; // Most recently used first
+    Map entries;
+};
+
+// --- Content-Encoding for static files ---
+
+enum class StaticEncoding { Identity, Gzip, Brotli };
+
+// Only text-like types are worth compressing; images, video, fonts and pdf are already compressed
+static bool is_compressible_mime(std::string_view mime_type) {
+    return mime_type.substr(0, 5) == "text/"
+        || mime_type == "application/javascript"
+        || mime_type == "application/json"
+        || mime_type == "image/svg+xml"
+        || mime_type == "image/x-icon";
+}
+
+// Which codings the client accepts, honouring "q=0" exclusions (e.g. "gzip;q=0, br").
+// "*" only covers codings the header does not name (RFC 9110 12.5.3), so "br;q=0, *"
+// still refuses br wherever the wildcard appears.
+static void parse_accept_encoding(std::string_view header, bool& accepts_br, bool& accepts_gzip) {
+    accepts_br = false;
+    accepts_gzip = false;
+    bool br_listed = false, gzip_listed = false;
+    bool wildcard_listed = false, wildcard_allowed = false;
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view item = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view coding = item.substr(0, semicolon);
+        while (!coding.empty() && coding.front() == ' ') coding.remove_prefix(1);
+        while (!coding.empty() && coding.back() == ' ') coding.remove_suffix(1);
+
+        bool allowed = true;
+        if (semicolon != std::string_view::npos) {
+            std::string params(item.substr(semicolon + 1));
+            size_t q = params.find("q=");
+            if (q != std::string::npos && std::strtod(params.c_str() + q + 2, nullptr) <= 0.0) {
+                allowed = false;
+            }
+        }
+
+        if (coding == "br") {
+            accepts_br = allowed;
+            br_listed = true;
+        } else if (coding == "gzip" || coding == "x-gzip") {
+            accepts_gzip = allowed;
+            gzip_listed = true;
+        } else if (coding == "*") {
+            wildcard_allowed = allowed;
+            wildcard_listed = true;
+        }
+    }
+    if (wildcard_listed) {
+        if (!br_listed) accepts_br = wildcard_allowed;
+        if (!gzip_listed) accepts_gzip = wildcard_allowed;
+    }
+}
+
+// Encoded variants get their own validator so caches never mix them up
+static std::string variant_etag(const std::string& etag, StaticEncoding encoding) {
+    if (encoding == StaticEncoding::Identity || etag.size() < 2) return etag;
+    std::string tagged = etag.substr(0, etag.size() - 1);
+    tagged += encoding == StaticEncoding::Brotli ? "-br\"" : "-gz\"";
+    return tagged;
+}
+
+static const char *encoding_token(StaticEncoding encoding) {
+    return encoding == StaticEncoding::Brotli ? "br" : "gzip";
+}
+
+// One-shot gzip (RFC 1952) of an in-memory body; returns false if zlib fails
+static bool gzip_compress(const std::string& input, std::string& output) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+// A sibling is only used when it is a regular file at least as new as the original,
+// so a stale app.js.gz never shadows a freshly deployed app.js
+static bool fresh_sibling(const std::string& path, const struct stat& original, struct stat& sibling) {
+    return stat(path.c_str(), &sibling) == 0 && S_ISREG(sibling.st_mode)
+        && sibling.st_mtim.tv_sec >= original.st_mtim.tv_sec;
+}
+
+// Fills br_body/gzip_body for a freshly read entry: precompressed siblings win,
+// otherwise compressible types are gzipped once here when the entry is going into the
+// cache (will_cache). Uncached entries are only marked, see serve_static_entry.
+static void load_encoded_variants(StaticFileCache::Entry& entry, const struct stat& st, bool will_cache) {
+    struct stat sibling;
+    std::string error;
+
+    if (fresh_sibling(entry.path + ".br", st, sibling)) {
+        entry.br_body = read_whole_file(entry.path + ".br", error);
+        if (!error.empty()) entry.br_body.clear();
+    }
+    if (fresh_sibling(entry.path + ".gz", st, sibling)) {
+        error.clear();
+        entry.gzip_body = read_whole_file(entry.path + ".gz", error);
+        if (!error.empty()) entry.gzip_body.clear();
+    }
+
+    if (entry.gzip_body.empty() && entry.body.size() >= GZIP_MIN_SIZE && is_compressible_mime(entry.content_type)) {
+        if (!will_cache) {
+            entry.gzip_on_demand = true;
+            return;
+        }
+        std::string compressed;
+        if (gzip_compress(entry.body, compressed) && compressed.size() < entry.body.size()) {
+            entry.gzip_body = std::move(compressed);
+        }
+    }
+}
+
+static StaticEncoding choose_entry_encoding(const StaticFileCache::Entry& entry, bool accepts_br, bool accepts_gzip) {
+    if (accepts_br && !entry.br_body.empty()) return StaticEncoding::Brotli;
+    if (accepts_gzip && (!entry.gzip_body.empty() || entry.gzip_on_demand)) return StaticEncoding::Gzip;
+    return StaticEncoding::Identity;
+}
+
+// Full 200 response for a file held in memory
+static void send_static_entry(uWS::HttpResponse<false> *res, const StaticFileCache::Entry& entry, StaticEncoding encoding) {
+    res->writeHeader("Content-Type", entry.content_type);
+    res->writeHeader("ETag", variant_etag(entry.etag, encoding));
+    res->writeHeader("Last-Modified", entry.last_modified);
+    if (!entry.br_body.empty() || !entry.gzip_body.empty() || entry.gzip_on_demand) {
+        res->writeHeader("Vary", "Accept-Encoding");
+    }
+    switch (encoding) {
+        case StaticEncoding::Brotli:
+            res->writeHeader("Content-Encoding", "br");
+            res->end(entry.br_body);
+            break;
+        case StaticEncoding::Gzip:
+            res->writeHeader("Content-Encoding", "gzip");
+            res->end(entry.gzip_body);
+            break;
+        default:
+            res->end(entry.body);
+            break;
+    }
+}
+
+// Answers from a complete entry, including conditional requests. An uncached entry
+// marked gzip_on_demand is compressed here, only for a 200 that goes out gzipped.
+static void serve_static_entry(uWS::HttpResponse<false> *res, StaticFileCache::Entry& entry,
+                               bool accepts_br, bool accepts_gzip,
+                               std::string_view if_none_match, std::string_view if_modified_since) {
+    StaticEncoding encoding = choose_entry_encoding(entry, accepts_br, accepts_gzip);
+    std::string etag = variant_etag(entry.etag, encoding);
+    if (is_not_modified(if_none_match, if_modified_since, etag, entry.mtime)) {
+        send_not_modified(res, etag, entry.last_modified,
+                          !entry.br_body.empty() || !entry.gzip_body.empty() || entry.gzip_on_demand);
+        return;
+    }
+    if (encoding == StaticEncoding::Gzip && entry.gzip_body.empty()) {
+        std::string compressed;
+        if (gzip_compress(entry.body, compressed) && compressed.size() < entry.body.size()) {
+            entry.gzip_body = std::move(compressed);
+        } else {
+            encoding = StaticEncoding::Identity;
+        }
+    }
+    send_static_entry(res, entry, encoding);
+}
+
+// Enhanced static file serving function with proper completion handling
+// Expected usage: app.serve_static("/assets", "./public", { cache = true, cache_bytes = 64 * 1024 * 1024,
+//                                                           max_cached_file = 1024 * 1024, revalidate_ms = 1000,
+//                                                           sendfile = true })
+int uw_serve_static(lua_State *L) {
+    const char *route_prefix = luaL_checkstring(L, 1);
+    const char *dir_path = luaL_checkstring(L, 2);
+
+    if (!fs::is_directory(dir_path)) {
+        std::cerr << "ERROR: Static file directory '" << dir_path 
+                  << "' does not exist or is not a directory." << std::endl;
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    bool cache_enabled = true;
+    size_t cache_bytes = STATIC_CACHE_BYTES;
+    size_t max_cached_file = STATIC_CACHE_MAX_FILE;
+    unsigned int revalidate_ms = STATIC_CACHE_REVALIDATE_MS;
+    bool use_sendfile = true;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "cache");
+        if (lua_isboolean(L, -1)) cache_enabled = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "cache_bytes");
+        if (lua_isnumber(L, -1)) cache_bytes = static_cast<size_t>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "max_cached_file");
+        if (lua_isnumber(L, -1)) max_cached_file = static_cast<size_t>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "revalidate_ms");
+        if (lua_isnumber(L, -1)) revalidate_ms = static_cast<unsigned int>(lua_tointeger(L, -1));
+        lua_getfield(L, 3, "sendfile");
+        if (lua_isboolean(L, -1)) use_sendfile = lua_toboolean(L, -1);
+        lua_pop(L, 5);
+    }
+
+    std::shared_ptr<StaticFileCache> cache;
+    if (cache_enabled) {
+        cache = std::make_shared<StaticFileCache>(cache_bytes, max_cached_file, std::chrono::milliseconds(revalidate_ms));
+    }
+
+    std::string route_pattern = std::string(route_prefix) + "/*";
+
+    app->get(route_pattern.c_str(), [dir_path_str = std::string(dir_path), 
+                                   route_prefix_str = std::string(route_prefix), cache, use_sendfile](auto *res, auto *req) {
+        try {
+            std::string_view url = req->getUrl();
+            std::string file_path_suffix = std::string(url.substr(route_prefix_str.length()));
+            
+            // Remove leading slash if present
+            if (!file_path_suffix.empty() && file_path_suffix[0] == '/') {
+                file_path_suffix.erase(0, 1);
+            }
+
+            bool accepts_br, accepts_gzip;
+            parse_accept_encoding(req->getHeader("accept-encoding"), accepts_br, accepts_gzip);
+
+            // Hot path: served from memory without touching the filesystem
+            if (cache) {
+                if (std::shared_ptr<StaticFileCache::Entry> entry = cache->get(file_path_suffix)) {
+                    serve_static_entry(res, *entry, accepts_br, accepts_gzip,
+                                       req->getHeader("if-none-match"), req->getHeader("if-modified-since"));
+                    return;
+                }
+            }
+
+            // Handle directory requests by appending index.html
+            fs::path full_path;
+            try {
+                full_path = sanitize_path(dir_path_str, file_path_suffix);
+                if (fs::is_directory(full_path)) {
+                    full_path /= "index.html";
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "SECURITY: " << e.what() << " for path: " << file_path_suffix << std::endl;
+                res->writeStatus("403 Forbidden")->end("Forbidden");
+                return;
+            }
+
+            // Check if file exists and is regular file, one stat() for everything we need
+            struct stat st;
+            if (stat(full_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                res->writeStatus("404 Not Found")->end("Not Found");
+                return;
+            }
+
+            // Get file size
+            size_t file_size = static_cast<size_t>(st.st_size);
+
+            std::string mime_type = get_mime_type(full_path.string());
+            std::string etag = make_etag(st);
+            std::string last_modified = format_http_date(st.st_mtim.tv_sec);
+
+            // Small (and cacheable) files are read whole, answered from memory and kept in the cache
+            if (file_size <= SMALL_FILE_THRESHOLD || (cache && cache->cacheable(file_size))) {
+                auto entry = std::make_shared<StaticFileCache::Entry>();
+                entry->path = full_path.string();
+                entry->content_type = mime_type;
+                entry->etag = etag;
+                entry->last_modified = last_modified;
+                entry->mtime = st.st_mtim.tv_sec;
+                entry->mtime_nsec = st.st_mtim.tv_nsec;
+                entry->size = st.st_size;
+                entry->validated = std::chrono::steady_clock::now();
+
+                // Go through the loop's io_uring when it is available and answer from the
+                // completion; otherwise read synchronously below
+                auto aborted = std::make_shared<bool>(false);
+                // The request is gone by the time the read completes, so the
+                // conditional headers are copied for the completion
+                bool will_cache = cache && cache->cacheable(file_size);
+                FileReadDone done = [res, aborted, entry, cache, st, accepts_br, accepts_gzip, will_cache,
+                                     if_none_match = std::string(req->getHeader("if-none-match")),
+                                     if_modified_since = std::string(req->getHeader("if-modified-since")),
+                                     key = file_path_suffix](std::string& content, const std::string& error) {
+                    if (error.empty()) {
+                        entry->body = std::move(content);
+                        load_encoded_variants(*entry, st, will_cache);
+                        if (will_cache) cache->put(key, entry);
+                    }
+                    if (*aborted) return;
+                    res->cork([&]() {
+                        if (!error.empty()) {
+                            std::cerr << "ERROR: " << error << std::endl;
+                            res->writeStatus("500 Internal Server Error")->end("File Read Error");
+                            return;
+                        }
+                        serve_static_entry(res, *entry, accepts_br, accepts_gzip, if_none_match, if_modified_since);
+                    });
+                };
+                if (file_size > 0 && submit_ring_read(entry->path, done)) {
+                    res->onAborted([aborted]() {
+                        *aborted = true;
+                    });
+                    return;
+                }
+
+                std::ifstream file(full_path, std::ios::binary);
+                if (!file) {
+                    std::cerr << "ERROR: Failed to open small file: " << full_path.string() << std::endl;
+                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
+                    return;
+                }
+
+                entry->body.resize(file_size);
+                if (!file.read(&entry->body[0], file_size)) {
+                    std::cerr << "ERROR: Failed to read small file: " << full_path.string() << std::endl;
+                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
+                    return;
+                }
+                load_encoded_variants(*entry, st, will_cache);
+                if (will_cache) cache->put(file_path_suffix, entry);
+                serve_static_entry(res, *entry, accepts_br, accepts_gzip,
+                                   req->getHeader("if-none-match"), req->getHeader("if-modified-since"));
+                return;
+            }
+
+            // Large files are streamed from disk and never compressed on the fly, but a
+            // precompressed sibling is streamed in place of the original when accepted
+            StaticEncoding encoding = StaticEncoding::Identity;
+            bool has_variants = false;
+            if (is_compressible_mime(mime_type)) {
+                struct stat sibling;
+                fs::path br_path = full_path.string() + ".br";
+                fs::path gz_path = full_path.string() + ".gz";
+                bool br_fresh = fresh_sibling(br_path.string(), st, sibling);
+                if (br_fresh && accepts_br) {
+                    encoding = StaticEncoding::Brotli;
+                    full_path = br_path;
+                    file_size = static_cast<size_t>(sibling.st_size);
+                }
+                bool gz_fresh = fresh_sibling(gz_path.string(), st, sibling);
+                if (gz_fresh && accepts_gzip && encoding == StaticEncoding::Identity) {
+                    encoding = StaticEncoding::Gzip;
+                    full_path = gz_path;
+                    file_size = static_cast<size_t>(sibling.st_size);
+                }
+                has_variants = br_fresh || gz_fresh;
+            }
+            etag = variant_etag(etag, encoding);
+
+            if (is_not_modified(req, etag, st.st_mtim.tv_sec)) {
+                send_not_modified(res, etag, last_modified, has_variants);
+                return;
+            }
+
+            // Range requests are served from a mapping of the selected representation.
+            // If-Range only honours the range when the client's validator is still current.
+            std::string_view range_header = req->getHeader("range");
+            std::string_view if_range = req->getHeader("if-range");
+            if (!range_header.empty() && (if_range.empty() || if_range == etag || if_range == last_modified)) {
+                std::vector<ByteRange> ranges;
+                RangeResult result = parse_range_header(range_header, file_size, ranges);
+                if (result == RangeResult::Unsatisfiable) {
+                    res->writeStatus("416 Range Not Satisfiable");
+                    res->writeHeader("Content-Range", "bytes */" + std::to_string(file_size));
+                    res->end();
+                    return;
+                }
+                if (result == RangeResult::Satisfiable) {
+                    try {
+                        auto mapped_file = std::make_shared<MappedFile>(full_path.string());
+                        res->writeStatus("206 Partial Content");
+                        res->writeHeader("Accept-Ranges", "bytes");
+                        res->writeHeader("ETag", etag);
+                        res->writeHeader("Last-Modified", last_modified);
+                        if (has_variants) {
+                            res->writeHeader("Vary", "Accept-Encoding");
+                        }
+                        if (encoding != StaticEncoding::Identity) {
+                            res->writeHeader("Content-Encoding", encoding_token(encoding));
+                        }
+                        send_byte_ranges(res, std::move(mapped_file), ranges, mime_type);
+                    } catch (const std::exception& e) {
+                        std::cerr << "ERROR: Failed to memory-map file " << full_path.string()
+                                  << ": " << e.what() << std::endl;
+                        res->writeStatus("500 Internal Server Error")->end("File Read Error");
+                    }
+                    return;
+                }
+            }
+
+            // Set headers
+            res->writeHeader("Content-Type", mime_type);
+            res->writeHeader("ETag", etag);
+            res->writeHeader("Last-Modified", last_modified);
+            res->writeHeader("Accept-Ranges", "bytes");
+            if (has_variants) {
+                res->writeHeader("Vary", "Accept-Encoding");
+            }
+            if (encoding != StaticEncoding::Identity) {
+                res->writeHeader("Content-Encoding", encoding_token(encoding));
+            }
+
+#ifdef __linux__
+            // The app only listens on plain TCP, so file pages can go straight to the socket
+            if (use_sendfile && file_size > 0 && start_sendfile(res, full_path.string(), file_size)) {
+                return;
+            }
+#endif
+
+            auto stream = std::make_shared<ResponseStream>();
+            stream->known_length = true;
+            stream->total = file_size;
+            stream->label = "file: " + full_path.string();
+
+            // For medium files, read through a reusable buffer
+            if (file_size <= MMAP_THRESHOLD) {
+                auto file_stream_ptr = std::make_shared<std::ifstream>(
+                    full_path, std::ios::binary
+                );
+
+                if (!file_stream_ptr->is_open()) {
+                    std::cerr << "ERROR: Could not open medium file: " << full_path.string() << std::endl;
+                    res->writeStatus("500 Internal Server Error")->end("Could not open file");
+                    return;
+                }
+
+                stream->reader = make_file_reader(std::move(file_stream_ptr), LARGE_FILE_CHUNK_SIZE);
+                start_stream(res, std::move(stream));
+            }
+            // For very large files (above MMAP_THRESHOLD), use memory-mapped I/O
+            else {
+                try {
+                    auto mapped_file = std::make_shared<MappedFile>(full_path.string());
+                    stream->total = mapped_file->getSize();
+                    stream->reader = make_mapped_reader(std::move(mapped_file));
+                    start_stream(res, std::move(stream));
+                } catch (const std::exception& e) {
+                    std::cerr << "ERROR: Failed to memory-map file " << full_path.string()
+                              << ": " << e.what() << std::endl;
+                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
+                }
+            }
+
+        } catch (const std::exception& e) {
+            std::cerr << "ERROR: Exception in static file handler: " << e.what() << std::endl;
+            if (!res->hasResponded()) {
+                res->writeStatus("500 Internal Server Error")->end("Internal Server Error");
+            }
+        }
+    });
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+// Serializes one SSE event. Every line of data gets its own "data:" field, as the
+// format requires for multi-line payloads.
+static std::string format_sse_event(std::string_view data, const char *event_name, const char *id) {
+    std::string frame;
+    frame.reserve(data.size() + 32 + (event_name ? strlen(event_name) : 0) + (id ? strlen(id) : 0));
+    if (id) {
+        frame += "id: ";
+        frame += id;
+        frame += "\n";
+    }
+    if (event_name) {
+        frame += "event: ";
+        frame += event_name;
+        frame += "\n";
+    }
+    size_t start = 0;
+    while (true) {
+        size_t end = data.find('\n', start);
+        frame += "data: ";
+        frame.append(data.data() + start, (end == std::string_view::npos ? data.size() : end) - start);
+        frame += "\n";
+        if (end == std::string_view::npos) break;
+        start = end + 1;
+    }
+    frame += "\n"; // A blank line terminates the event
+    return frame;
+}
+
+static thread_local std::unordered_map<std::string, std::unique_ptr<SseChannel>> sse_channels;
+
+static SseChannel* get_sse_channel(const std::string& name) {
+    auto& channel = sse_channels[name];
+    if (!channel) {
+        channel = std::make_unique<SseChannel>();
+        channel->name = name;
+    }
+    return channel.get();
+}
+
+static bool sse_subscribe(const std::shared_ptr<SseConnection>& conn, SseChannel *channel) {
+    for (const auto& membership : conn->channels) {
+        if (membership.first == channel) return false;
+    }
+    conn->channels.emplace_back(channel, channel->subscribers.size());
+    channel->subscribers.push_back(conn);
+    return true;
+}
+
+// Swap-removes conn from the channel and fixes the slot of the connection moved into its place
+static bool sse_unsubscribe(SseConnection *conn, SseChannel *channel) {
+    for (size_t i = 0; i < conn->channels.size(); i++) {
+        if (conn->channels[i].first != channel) continue;
+        size_t slot = conn->channels[i].second;
+        conn->channels[i] = conn->channels.back();
+        conn->channels.pop_back();
+
+        std::shared_ptr<SseConnection> moved = channel->subscribers.back();
+        channel->subscribers.pop_back();
+        if (slot < channel->subscribers.size()) {
+            channel->subscribers[slot] = moved;
+            for (auto& membership : moved->channels) {
+                if (membership.first == channel) membership.second = slot;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static void sse_unsubscribe_all(SseConnection *conn) {
+    while (!conn->channels.empty()) {
+        sse_unsubscribe(conn, conn->channels.back().first);
+    }
+}
+
+// Writes one serialized frame to every live subscriber, each write corked into a
+// single send; returns how many subscribers it reached
+static size_t sse_broadcast(SseChannel *channel, std::string_view frame) {
+    size_t delivered = 0;
+    for (size_t i = 0; i < channel->subscribers.size(); i++) {
+        SseConnection *conn = channel->subscribers[i].get();
+        if (conn->is_aborted) continue;
+        conn->res->cork([conn, frame]() {
+            conn->res->write(frame);
+        });
+        delivered++;
+    }
+    return delivered;
+}
+
+// Lua callable function to send an SSE event
+// Expected usage: uwebsockets.sse_send(sse_id, data, event_name_optional, id_optional)
+int uw_sse_send(lua_State *L) {
+    const char* sse_id = luaL_checkstring(L, 1);
+    const char* data = luaL_checkstring(L, 2);
+    const char* event_name = lua_isstring(L, 3) ? luaL_checkstring(L, 3) : nullptr;
+    const char* id = lua_isstring(L, 4) ? luaL_checkstring(L, 4) : nullptr;
+
+    std::lock_guard<std::mutex> lock(sse_connections_mutex); // Lock access to the map
+
+    auto it = active_sse_connections.find(sse_id);
+    if (it == active_sse_connections.end() || it->second->is_aborted) {
+        std::cerr << "SSE Connection with ID '" << sse_id << "' not found or aborted. Cannot send message." << std::endl;
+        lua_pushboolean(L, 0); // Indicate failure
+        lua_pushstring(L, "SSE connection not found or aborted.");
+        return 2;
+    }
+
+    uWS::HttpResponse<false>* res = it->second->res;
+
+    res->write(format_sse_event(data, event_name, id)); // Send the data
+
+    lua_pushboolean(L, 1); // Indicate success
+    return 1;
+}
+
+// Lua callable function to close an SSE connection
+// Expected usage: uwebsockets.sse_close(sse_id)
+int uw_sse_close(lua_State *L) {
+    const char* sse_id = luaL_checkstring(L, 1);
+
+    std::lock_guard<std::mutex> lock(sse_connections_mutex);
+
+    auto it = active_sse_connections.find(sse_id);
+    if (it != active_sse_connections.end()) {
+        if (!it->second->is_aborted) {
+            it->second->res->end(); // Gracefully close the HTTP response
+            it->second->is_aborted = true; // Mark as aborted
+            // An ended response never reports onAborted, so clean up here
+            sse_unsubscribe_all(it->second.get());
+            active_sse_connections.erase(it);
+            std::cout << "SSE Connection with ID '" << sse_id << "' explicitly closed by Lua." << std::endl;
+        } else {
+            std::cout << "SSE Connection with ID '" << sse_id << "' already aborted/closed." << std::endl;
+        }
+        lua_pushboolean(L, 1); // Indicate success (or that it was already closed)
+        return 1;
+    } else {
+        std::cerr << "SSE Connection with ID '" << sse_id << "' not found for closing." << std::endl;
+        lua_pushboolean(L, 0); // Indicate failure
+        lua_pushstring(L, "SSE connection not found.");
+        return 2;
+    }
+}
+
+
+// Lua callable function to set up an SSE route
+// Expected usage: uwebsockets.sse("/my-events", function(req, sse_conn_id) ... end)
+// The Lua callback receives req and the sse_conn_id (string) to manage the connection.
+// An optional third argument { channels = { "news", ... } } subscribes each connection
+// to those broadcast channels before the callback runs.
+int uw_sse(lua_State *L) {
+    const char *route = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2); // Push the Lua callback function onto the stack
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX); // Get a reference to the Lua function
+    int chain = compile_middleware_chain(route);
+
+    // Optional { channels = { "dashboard", ... } }: subscribe every connection at connect time
+    std::vector<SseChannel*> channels;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "channels");
+        if (lua_istable(L, -1)) {
+            int count = static_cast<int>(lua_objlen(L, -1));
+            for (int i = 1; i <= count; i++) {
+                lua_rawgeti(L, -1, i);
+                channels.push_back(get_sse_channel(luaL_checkstring(L, -1)));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    app->get(route, [ref, chain, channels](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+        if (!execute_middleware(main_L, res, req, chain)) {
+            // If middleware aborts, ensure the response is ended and headers not set for SSE
+            res->writeStatus("403 Forbidden")->end("Forbidden by middleware");
+            return;
+        }
+
+        // Generate a unique ID for this SSE connection
+        std::string sse_id = generate_unique_id();
+
+        // Set SSE specific headers
+        res->writeHeader("Content-Type", "text/event-stream");
+        res->writeHeader("Cache-Control", "no-cache");
+        res->writeHeader("Connection", "keep-alive");
+        // Optional: CORS headers if needed
+        // res->writeHeader("Access-Control-Allow-Origin", "*");
+
+        // Store the SseConnection in the global map
+        auto sse_conn = std::make_shared<SseConnection>();
+        sse_conn->res = res;
+        sse_conn->lua_ref = ref; // The same Lua callback ref for all connections to this route
+        sse_conn->is_aborted = false;
+        sse_conn->id = sse_id;
+        for (SseChannel *channel : channels) {
+            sse_subscribe(sse_conn, channel);
+        }
+
+        {
+            std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
+            active_sse_connections[sse_id] = sse_conn;
+        }
+
+        // Set up onAborted callback to clean up when client disconnects
+        res->onAborted([sse_id, sse_conn]() {
+            std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
+            std::cerr << "SSE connection aborted: " << sse_id << std::endl;
+            sse_conn->is_aborted = true; // Mark as aborted
+            sse_unsubscribe_all(sse_conn.get());
+            active_sse_connections.erase(sse_id); // Remove from map
+            // Note: The Lua ref (ref) is only removed when the module shuts down
+            // or if we were to decrement its ref count here (luaL_unref)
+            // For now, assume a single ref for the route's handler.
+        });
+
+        // Call the Lua callback to signal that a new SSE connection is ready
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref); // Push the Lua callback
+        create_req_userdata(main_L, req);            // Push req userdata
+        create_sse_res_userdata(main_L, res, sse_id); // Push the SSE connection ID
+
+        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
+            std::cerr << "Lua error in SSE route handler (initial call): " << lua_tostring(main_L, -1) << std::endl;
+            lua_pop(main_L, 1);
+            // If the Lua handler fails, close the SSE connection
+            res->end();
+            sse_conn->is_aborted = true;
+            sse_unsubscribe_all(sse_conn.get());
+            {
+                std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
+                active_sse_connections.erase(sse_id);
+            }
+        }
+        // IMPORTANT: Do NOT call res->end() here. The connection must stay open for SSE.
+    });
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Lua Usage: app:sse_subscribe(sse_id, channel) -> boolean (false if unknown or already subscribed)
+int uw_sse_subscribe(lua_State *L) {
+    int arg = first_arg_index(L);
+    const char *sse_id = luaL_checkstring(L, arg);
+    const char *channel = luaL_checkstring(L, arg + 1);
+
+    auto it = active_sse_connections.find(sse_id);
+    if (it == active_sse_connections.end() || it->second->is_aborted) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, sse_subscribe(it->second, get_sse_channel(channel)));
+    return 1;
+}
+
+// Lua Usage: app:sse_unsubscribe(sse_id, channel) -> boolean
+int uw_sse_unsubscribe(lua_State *L) {
+    int arg = first_arg_index(L);
+    const char *sse_id = luaL_checkstring(L, arg);
+    const char *channel = luaL_checkstring(L, arg + 1);
+
+    auto it = active_sse_connections.find(sse_id);
+    auto channel_it = sse_channels.find(channel);
+    if (it == active_sse_connections.end() || channel_it == sse_channels.end()) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, sse_unsubscribe(it->second.get(), channel_it->second.get()));
+    return 1;
+}
+
+// Lua Usage: app:sse_publish(channel, data [, event [, id]]) -> number of subscribers reached
+// The event is serialized once and the same bytes are written to every subscriber.
+int uw_sse_publish(lua_State *L) {
+    int arg = first_arg_index(L);
+    const char *channel = luaL_checkstring(L, arg);
+    size_t len;
+    const char *data = luaL_checklstring(L, arg + 1, &len);
+    const char *event_name = lua_isstring(L, arg + 2) ? lua_tostring(L, arg + 2) : nullptr;
+    const char *id = lua_isstring(L, arg + 3) ? lua_tostring(L, arg + 3) : nullptr;
+
+    auto it = sse_channels.find(channel);
+    if (it == sse_channels.end()) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    std::string frame = format_sse_event(std::string_view(data, len), event_name, id);
+    lua_pushinteger(L, static_cast<lua_Integer>(sse_broadcast(it->second.get(), frame)));
+    return 1;
+}
+
+// Lua Usage: local chan = app:sse_channel("dashboard")
+//   chan:subscribe(sse_id), chan:unsubscribe(sse_id), chan:publish(data [, event [, id]]), chan:count()
+// A channel exists from its first use; the handle only keeps its name.
+static SseChannel* check_sse_channel(lua_State *L, int index) {
+    return *static_cast<SseChannel**>(luaL_checkudata(L, index, "sse.channel"));
+}
+
+static int sse_channel_subscribe(lua_State *L) {
+    SseChannel *channel = check_sse_channel(L, 1);
+    auto it = active_sse_connections.find(luaL_checkstring(L, 2));
+    lua_pushboolean(L, it != active_sse_connections.end() && !it->second->is_aborted && sse_subscribe(it->second, channel));
+    return 1;
+}
+
+static int sse_channel_unsubscribe(lua_State *L) {
+    SseChannel *channel = check_sse_channel(L, 1);
+    auto it = active_sse_connections.find(luaL_checkstring(L, 2));
+    lua_pushboolean(L, it != active_sse_connections.end() && sse_unsubscribe(it->second.get(), channel));
+    return 1;
+}
+
+static int sse_channel_publish(lua_State *L) {
+    SseChannel *channel = check_sse_channel(L, 1);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    const char *event_name = lua_isstring(L, 3) ? lua_tostring(L, 3) : nullptr;
+    const char *id = lua_isstring(L, 4) ? lua_tostring(L, 4) : nullptr;
+    std::string frame = format_sse_event(std::string_view(data, len), event_name, id);
+    lua_pushinteger(L, static_cast<lua_Integer>(sse_broadcast(channel, frame)));
+    return 1;
+}
+
+static int sse_channel_count(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(check_sse_channel(L, 1)->subscribers.size()));
+    return 1;
+}
+
+int uw_sse_channel(lua_State *L) {
+    const char *name = luaL_checkstring(L, first_arg_index(L));
+    SseChannel **ud = static_cast<SseChannel**>(lua_newuserdata(L, sizeof(SseChannel*)));
+    *ud = get_sse_channel(name);
+
+    if (luaL_newmetatable(L, "sse.channel")) {
+        lua_newtable(L);
+        lua_pushcfunction(L, sse_channel_subscribe);
+        lua_setfield(L, -2, "subscribe");
+        lua_pushcfunction(L, sse_channel_unsubscribe);
+        lua_setfield(L, -2, "unsubscribe");
+        lua_pushcfunction(L, sse_channel_publish);
+        lua_setfield(L, -2, "publish");
+        lua_pushcfunction(L, sse_channel_count);
+        lua_setfield(L, -2, "count");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// file operation functions
+
+// Lua is only ever entered from the loop thread. The async variants below do their
+// blocking work on the shared I/O pool and hand the result back through the
+// issuing loop's CompletionQueue, which runs the Lua callback on that loop.
+
+// --- Bounded I/O thread pool ---
+// A fixed set of workers fed from a bounded FIFO. It is process-wide: cluster workers
+// share it, and every job carries the completion queue of the loop that submitted it.
+// submit() refuses work instead of blocking once the queue is full, so a burst of
+// uploads degrades into "queue full" errors rather than thread or memory exhaustion.
+class IoThreadPool {
+public:
+    using Job = uWS::MoveOnlyFunction<void()>;
+
+    ~IoThreadPool() {
+        stop();
+    }
+
+    // (Re)start with the given sizes. Queued jobs are kept and picked up by the new
+    // workers; the old ones finish the job they are running and exit on their own,
+    // so the calling loop never waits for the queue to drain.
+    void configure(size_t threads, size_t queue_capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        reap_retired_locked();
+        max_queue = queue_capacity > 0 ? queue_capacity : 1;
+        generation++;
+        for (auto &worker : workers) {
+            retired.push_back(std::move(worker));
+        }
+        workers.clear();
+        start_locked(threads > 0 ? threads : 1);
+        cv.notify_all();
+    }
+
+    bool submit(Job &&fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (workers.empty()) {
+                start_locked(default_thread_count());
+            }
+            if (queue.size() >= max_queue) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            queue.push_back(QueuedJob{std::move(fn), std::chrono::steady_clock::now()});
+            submitted.fetch_add(1, std::memory_order_relaxed);
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    void push_stats(lua_State *L) {
+        size_t depth, capacity, threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            depth = queue.size();
+            capacity = max_queue;
+            threads = workers.size();
+        }
+        uint64_t done = completed.load(std::memory_order_relaxed);
+
+        lua_newtable(L);
+        lua_pushinteger(L, threads);                                    lua_setfield(L, -2, "threads");
+        lua_pushinteger(L, capacity);                                   lua_setfield(L, -2, "queue_capacity");
+        lua_pushinteger(L, depth);                                      lua_setfield(L, -2, "queue_depth");
+        lua_pushinteger(L, in_flight.load(std::memory_order_relaxed));  lua_setfield(L, -2, "in_flight");
+        lua_pushnumber(L, submitted.load(std::memory_order_relaxed));   lua_setfield(L, -2, "submitted");
+        lua_pushnumber(L, done);                                        lua_setfield(L, -2, "completed");
+        lua_pushnumber(L, rejected.load(std::memory_order_relaxed));    lua_setfield(L, -2, "rejected");
+        lua_pushnumber(L, done ? wait_us_total.load(std::memory_order_relaxed) / 1000.0 / done : 0.0);
+        lua_setfield(L, -2, "avg_wait_ms");
+        lua_pushnumber(L, wait_us_max.load(std::memory_order_relaxed) / 1000.0);
+        lua_setfield(L, -2, "max_wait_ms");
+        lua_pushnumber(L, done ? run_us_total.load(std::memory_order_relaxed) / 1000.0 / done : 0.0);
+        lua_setfield(L, -2, "avg_run_ms");
+    }
 
-                    // Send first chunk
-                    size_t first_chunk = std::min(LARGE_FILE_CHUNK_SIZE, mapped_file->getSize());
-                    if (first_chunk > 0) {
-                        res->write(std::string_view(mapped_file->getData(), first_chunk));
-                    }
-                } catch (const std::exception& e) {
-                    std::cerr << "ERROR: Failed to memory-map file " << full_path.string() 
-                              << ": " << e.what() << std::endl;
-                    res->writeStatus("500 Internal Server Error")->end("File Read Error");
-                }
+private:
+    struct QueuedJob {
+        Job fn;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    // A worker thread and the flag it raises on exit, so retired workers can be joined
+    // once they are known to be done instead of blocking whoever retired them
+    struct Worker {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> exited;
+    };
+
+    static size_t default_thread_count() {
+        size_t n = std::thread::hardware_concurrency();
+        return n < 2 ? 2 : n;
+    }
+
+    void start_locked(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            auto exited = std::make_shared<std::atomic<bool>>(false);
+            uint64_t worker_generation = generation;
+            workers.push_back(Worker{std::thread([this, worker_generation, exited]() {
+                worker_loop(worker_generation);
+                exited->store(true, std::memory_order_release);
+            }), exited});
+        }
+    }
+
+    void reap_retired_locked() {
+        for (size_t i = 0; i < retired.size();) {
+            if (retired[i].exited->load(std::memory_order_acquire)) {
+                retired[i].thread.join(); // Already returned, does not block
+                retired[i] = std::move(retired.back());
+                retired.pop_back();
+            } else {
+                i++;
             }
+        }
+    }
 
-        } catch (const std::exception& e) {
-            std::cerr << "ERROR: Exception in static file handler: " << e.what() << std::endl;
-            if (!res->hasResponded()) {
-                res->writeStatus("500 Internal Server Error")->end("Internal Server Error");
+    // Process shutdown only: the current workers drain the queue, then everything is joined
+    void stop() {
+        std::vector<Worker> joining;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            joining.swap(workers);
+            for (auto &worker : retired) {
+                joining.push_back(std::move(worker));
             }
+            retired.clear();
         }
-    });
+        cv.notify_all();
+        for (auto &worker : joining) {
+            worker.thread.join();
+        }
+    }
 
-    lua_pushboolean(L, 1);
-    return 1;
-}
+    void worker_loop(uint64_t worker_generation) {
+        for (;;) {
+            QueuedJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this, worker_generation]() {
+                    return stopping || generation != worker_generation || !queue.empty();
+                });
+                if (generation != worker_generation) return; // Replaced by configure()
+                if (queue.empty()) return; // stopping and fully drained
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
 
+            auto started = std::chrono::steady_clock::now();
+            uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(started - job.enqueued).count();
+            in_flight.fetch_add(1, std::memory_order_relaxed);
 
-// Lua callable function to send an SSE event
-// Expected usage: uwebsockets.sse_send(sse_id, data, event_name_optional, id_optional)
-int uw_sse_send(lua_State *L) {
-    const char* sse_id = luaL_checkstring(L, 1);
-    const char* data = luaL_checkstring(L, 2);
-    const char* event_name = lua_isstring(L, 3) ? luaL_checkstring(L, 3) : nullptr;
-    const char* id = lua_isstring(L, 4) ? luaL_checkstring(L, 4) : nullptr;
+            job.fn();
 
-    std::lock_guard<std::mutex> lock(sse_connections_mutex); // Lock access to the map
+            uint64_t run_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started).count();
+            in_flight.fetch_sub(1, std::memory_order_relaxed);
+            wait_us_total.fetch_add(wait_us, std::memory_order_relaxed);
+            run_us_total.fetch_add(run_us, std::memory_order_relaxed);
+            uint64_t prev_max = wait_us_max.load(std::memory_order_relaxed);
+            while (wait_us > prev_max && !wait_us_max.compare_exchange_weak(prev_max, wait_us, std::memory_order_relaxed)) {}
+            completed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
-    auto it = active_sse_connections.find(sse_id);
-    if (it == active_sse_connections.end() || it->second->is_aborted) {
-        std::cerr << "SSE Connection with ID '" << sse_id << "' not found or aborted. Cannot send message." << std::endl;
-        lua_pushboolean(L, 0); // Indicate failure
-        lua_pushstring(L, "SSE connection not found or aborted.");
-        return 2;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<QueuedJob> queue;
+    std::vector<Worker> workers;
+    std::vector<Worker> retired;
+    uint64_t generation = 0; // Bumped by configure(); workers of older generations exit
+    size_t max_queue = 4096;
+    bool stopping = false;
+
+    std::atomic<uint64_t> submitted{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> wait_us_total{0};
+    std::atomic<uint64_t> wait_us_max{0};
+    std::atomic<uint64_t> run_us_total{0};
+    std::atomic<int> in_flight{0};
+};
+
+static IoThreadPool io_pool;
+
+// Runtime switch, app:configure_io{io_uring = false} forces the thread pool
+static std::atomic<bool> io_uring_enabled{true};
+
+#ifdef UWS_LUA_HAVE_IO_URING
+
+extern "C" {
+// uSockets internals (internal/internal.h, checked by CMake): an eventfd poll whose callback runs on the
+// loop thread. Loop::defer's wakeup is built on the same primitive. Registering that
+// eventfd with the ring makes kernel completions wake the loop directly.
+struct us_internal_async;
+struct us_internal_async *us_internal_create_async(struct us_loop_t *loop, int fallthrough, unsigned int ext_size);
+void us_internal_async_close(struct us_internal_async *a);
+void us_internal_async_set(struct us_internal_async *a, void (*cb)(struct us_internal_async *));
+}
+
+// Minimal io_uring driver (raw syscalls, no liburing) for whole-file reads and writes.
+// One ring per loop thread. SQEs queued during an iteration are submitted together from
+// a loop post handler, and CQEs are reaped when the ring's eventfd fires in the loop,
+// so results land on the loop thread with no helper thread involved.
+class IoUringBackend {
+public:
+    static std::unique_ptr<IoUringBackend> create(unsigned entries) {
+        std::unique_ptr<IoUringBackend> ring(new IoUringBackend());
+        if (!ring->setup(entries)) {
+            return nullptr;
+        }
+        return ring;
     }
 
-    uWS::HttpResponse<false>* res = it->second->res;
+    ~IoUringBackend() {
+        if (post_handler_registered) {
+            uWS::Loop::get()->removePostHandler(this);
+        }
+        // The kernel may still be filling buffers of pending ops, so they are cancelled
+        // and their completions reaped before anything is freed
+        if (!cancel_pending()) {
+            // The ring could not be drained; leaking the ops is safer than freeing
+            // buffers the kernel can still write to
+            std::cerr << "io_uring: " << pending.size() << " operations still in flight at shutdown" << std::endl;
+            pending.clear();
+        }
+        if (async) {
+            us_internal_async_close(async);
+        }
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if (ring_fd != -1) close(ring_fd);
+    }
 
-    // Construct the SSE message
-    std::string sse_message;
-    if (id) {
-        sse_message += "id: ";
-        sse_message += id;
-        sse_message += "\n";
+    // Returns false without consuming `done` when the caller should fall back to the pool
+    bool read_file(const std::string& path, FileReadDone& done) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+
+        struct stat st;
+        // Empty and special files (e.g. /proc) report no usable size; let the pool stream them
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        Op *op = new Op();
+        op->fd = fd;
+        op->is_write = false;
+        op->path = path;
+        op->buffer.resize(static_cast<size_t>(st.st_size));
+        if (!queue_op(op)) {
+            close(fd);
+            delete op;
+            return false;
+        }
+        op->on_read = std::move(done);
+        pending.insert(op);
+        return true;
     }
-    if (event_name) {
-        sse_message += "event: ";
-        sse_message += event_name;
-        sse_message += "\n";
+
+    bool write_file(const std::string& path, std::string& data, FileWriteDone& done) {
+        if (data.empty()) return false;
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) return false;
+
+        Op *op = new Op();
+        op->fd = fd;
+        op->is_write = true;
+        op->path = path;
+        op->buffer = std::move(data);
+        if (!queue_op(op)) {
+            data = std::move(op->buffer);
+            close(fd);
+            delete op;
+            return false;
+        }
+        op->on_write = std::move(done);
+        pending.insert(op);
+        return true;
     }
-    sse_message += "data: ";
-    sse_message += data;
-    sse_message += "\n\n"; // Two newlines to terminate the event
 
-    res->write(sse_message); // Send the data
+    size_t in_flight() const { return pending.size(); }
+
+private:
+    struct Op {
+        int fd = -1;
+        bool is_write = false;
+        std::string path;
+        std::string buffer;
+        size_t done = 0;
+        FileReadDone on_read;
+        FileWriteDone on_write;
+    };
 
-    lua_pushboolean(L, 1); // Indicate success
-    return 1;
-}
+    IoUringBackend() = default;
 
-// Lua callable function to close an SSE connection
-// Expected usage: uwebsockets.sse_close(sse_id)
-int uw_sse_close(lua_State *L) {
-    const char* sse_id = luaL_checkstring(L, 1);
+    bool setup(unsigned entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd < 0) {
+            ring_fd = -1;
+            return false;
+        }
 
-    std::lock_guard<std::mutex> lock(sse_connections_mutex);
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
 
-    auto it = active_sse_connections.find(sse_id);
-    if (it != active_sse_connections.end()) {
-        if (!it->second->is_aborted) {
-            it->second->res->end(); // Gracefully close the HTTP response
-            it->second->is_aborted = true; // Mark as aborted
-            // The onAborted callback will handle removal from the map
-            std::cout << "SSE Connection with ID '" << sse_id << "' explicitly closed by Lua." << std::endl;
-        } else {
-            std::cout << "SSE Connection with ID '" << sse_id << "' already aborted/closed." << std::endl;
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        cq_ptr = single_mmap ? sq_ptr
+            : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) return false;
+        sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = static_cast<char*>(sq_ptr);
+        char *cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // IORING_OP_READ/WRITE need Linux 5.6; older kernels fall back to the pool
+        std::vector<char> probe_buf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe*>(probe_buf.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0
+            || probe->ops_len <= IORING_OP_WRITE
+            || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+            || !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
         }
-        lua_pushboolean(L, 1); // Indicate success (or that it was already closed)
-        return 1;
-    } else {
-        std::cerr << "SSE Connection with ID '" << sse_id << "' not found for closing." << std::endl;
-        lua_pushboolean(L, 0); // Indicate failure
-        lua_pushstring(L, "SSE connection not found.");
-        return 2;
+
+        async = us_internal_create_async(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 1, 0);
+        if (!async) return false;
+        int event_fd = us_poll_fd(reinterpret_cast<us_poll_t*>(async));
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+            return false;
+        }
+        us_internal_async_set(async, on_ring_event);
+
+        uWS::Loop::get()->addPostHandler(this, [this](uWS::Loop *) {
+            submit();
+        });
+        post_handler_registered = true;
+        return true;
     }
-}
 
+    static void on_ring_event(struct us_internal_async *);
 
-// Lua callable function to set up an SSE route
-// Expected usage: uwebsockets.sse("/my-events", function(req, sse_conn_id) ... end)
-// The Lua callback receives req and the sse_conn_id (string) to manage the connection.
-int uw_sse(lua_State *L) {
-    const char *route = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    lua_pushvalue(L, 2); // Push the Lua callback function onto the stack
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX); // Get a reference to the Lua function
+    // Cancels every pending op and waits for all of their CQEs. Ops fail through their
+    // callbacks with the cancellation error. Returns false if the ring stopped accepting work.
+    bool cancel_pending() {
+        if (pending.empty()) return true;
+        shutting_down = true;
 
-    app->get(route, [ref, route](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
-        if (!execute_middleware(main_L, res, req, route)) {
-            // If middleware aborts, ensure the response is ended and headers not set for SSE
-            res->writeStatus("403 Forbidden")->end("Forbidden by middleware");
-            return;
+        std::vector<Op*> cancelling(pending.begin(), pending.end());
+        for (Op *op : cancelling) {
+            while (!queue_cancel(op)) {
+                if (!wait_for_completions()) return false;
+            }
         }
+        while (!pending.empty()) {
+            if (!wait_for_completions()) return false;
+        }
+        return true;
+    }
 
-        // Generate a unique ID for this SSE connection
-        std::string sse_id = generate_unique_id();
+    bool queue_cancel(Op *op) {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit();
+            if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return false;
+            }
+        }
 
-        // Set SSE specific headers
-        res->writeHeader("Content-Type", "text/event-stream");
-        res->writeHeader("Cache-Control", "no-cache");
-        res->writeHeader("Connection", "keep-alive");
-        // Optional: CORS headers if needed
-        // res->writeHeader("Access-Control-Allow-Origin", "*");
+        unsigned index = tail & sq_mask;
+        struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(op);
+        sqe->user_data = 0; // Cancel results are not ops
+        sq_array[index] = index;
+
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        return true;
+    }
 
-        // Store the SseConnection in the global map
-        auto sse_conn = std::make_shared<SseConnection>();
-        sse_conn->res = res;
-        sse_conn->lua_ref = ref; // The same Lua callback ref for all connections to this route
-        sse_conn->is_aborted = false;
+    // Submits what is queued and blocks until at least one CQE is available, then reaps
+    bool wait_for_completions() {
+        for (;;) {
+            long entered = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (entered < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            unsubmitted -= static_cast<unsigned>(entered);
+            break;
+        }
+        reap();
+        return true;
+    }
 
-        {
-            std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
-            active_sse_connections[sse_id] = sse_conn;
+    // Fill one SQE covering the unfinished part of `op`; the kernel sees it on submit()
+    bool queue_op(Op *op) {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit();
+            if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return false;
+            }
         }
 
-        // Set up onAborted callback to clean up when client disconnects
-        res->onAborted([sse_id, sse_conn]() {
-            std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
-            std::cerr << "SSE connection aborted: " << sse_id << std::endl;
-            sse_conn->is_aborted = true; // Mark as aborted
-            active_sse_connections.erase(sse_id); // Remove from map
-            // Note: The Lua ref (ref) is only removed when the module shuts down
-            // or if we were to decrement its ref count here (luaL_unref)
-            // For now, assume a single ref for the route's handler.
-        });
+        unsigned index = tail & sq_mask;
+        struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = op->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&op->buffer[op->done]);
+        sqe->len = static_cast<uint32_t>(std::min<size_t>(op->buffer.size() - op->done, 1u << 30));
+        sqe->off = op->done;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        sq_array[index] = index;
+
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        return true;
+    }
 
-        // Call the Lua callback to signal that a new SSE connection is ready
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, ref); // Push the Lua callback
-        create_req_userdata(main_L, req);            // Push req userdata
-        create_sse_res_userdata(main_L, res, sse_id); // Push the SSE connection ID
+    void submit() {
+        while (unsubmitted) {
+            long submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0, 0, nullptr, 0);
+            if (submitted < 0) {
+                if (errno == EINTR) continue;
+                return; // EAGAIN/EBUSY: retried after the next iteration
+            }
+            unsubmitted -= static_cast<unsigned>(submitted);
+            if (submitted == 0) return;
+        }
+    }
 
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
-            std::cerr << "Lua error in SSE route handler (initial call): " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1);
-            // If the Lua handler fails, close the SSE connection
-            res->end();
-            {
-                std::lock_guard<std::mutex> map_lock(sse_connections_mutex);
-                active_sse_connections.erase(sse_id);
+    void reap() {
+        for (;;) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+
+            struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            Op *op = reinterpret_cast<Op*>(cqe->user_data);
+            int result = cqe->res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (op) handle_completion(op, result);
+        }
+        submit();
+    }
+
+    void handle_completion(Op *op, int result) {
+        // A partial transfer would need another SQE, which shutdown no longer submits
+        if (shutting_down && result > 0 && op->done + static_cast<size_t>(result) < op->buffer.size()) {
+            finish(op, "io_uring shut down before completion: " + op->path);
+            return;
+        }
+        if (result == -EAGAIN || result == -EINTR) {
+            if (shutting_down || !queue_op(op)) finish(op, "io_uring submission queue full: " + op->path);
+            return;
+        }
+        if (result < 0) {
+            finish(op, std::string(op->is_write ? "Error writing data to file: " : "Error reading file content: ")
+                       + op->path + ": " + strerror(-result));
+            return;
+        }
+        if (result == 0) {
+            if (op->is_write) {
+                finish(op, "Error writing data to file: " + op->path);
+            } else {
+                op->buffer.resize(op->done); // File shrank while reading
+                finish(op, std::string());
             }
+            return;
         }
-        // IMPORTANT: Do NOT call res->end() here. The connection must stay open for SSE.
-    });
 
+        op->done += static_cast<size_t>(result);
+        if (op->done < op->buffer.size()) {
+            if (!queue_op(op)) finish(op, "io_uring submission queue full: " + op->path);
+            return;
+        }
+        finish(op, std::string());
+    }
+
+    void finish(Op *op, const std::string& error) {
+        pending.erase(op);
+        close(op->fd);
+        op->fd = -1;
+        if (op->is_write) {
+            op->on_write(error.empty(), error);
+        } else {
+            op->on_read(op->buffer, error);
+        }
+        delete op;
+    }
+
+    int ring_fd = -1;
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0;
+    struct io_uring_cqe *cqes = nullptr;
+    unsigned unsubmitted = 0;
+    struct us_internal_async *async = nullptr;
+    bool post_handler_registered = false;
+    bool shutting_down = false; // Set by the destructor: completions are not resubmitted
+    std::unordered_set<Op*> pending;
+};
+
+static thread_local std::unique_ptr<IoUringBackend> io_uring_backend;
+static thread_local bool io_uring_probed = false;
+
+void IoUringBackend::on_ring_event(struct us_internal_async *) {
+    if (io_uring_backend) {
+        io_uring_backend->reap();
+    }
+}
+
+// Ring of the calling loop thread, set up on first use; nullptr when io_uring is
+// disabled or not supported by the running kernel
+static IoUringBackend *get_io_uring() {
+    if (!io_uring_enabled.load(std::memory_order_relaxed)) return nullptr;
+    if (!io_uring_probed) {
+        io_uring_probed = true;
+        io_uring_backend = IoUringBackend::create(256);
+        if (!io_uring_backend) {
+            std::cerr << "io_uring not available, file I/O uses the thread pool" << std::endl;
+        }
+    }
+    return io_uring_backend.get();
+}
+
+static void shutdown_io_uring() {
+    io_uring_backend.reset();
+    io_uring_probed = false;
+}
+
+#endif // UWS_LUA_HAVE_IO_URING
+
+// Lua callable function to size the I/O pool
+// Expected usage: app:configure_io{threads = 8, queue = 4096, io_uring = true}
+int uw_configure_io(lua_State *L) {
+    int opts = first_arg_index(L);
+    luaL_checktype(L, opts, LUA_TTABLE);
+
+    lua_getfield(L, opts, "threads");
+    lua_Integer threads = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : std::thread::hardware_concurrency();
+    lua_getfield(L, opts, "queue");
+    lua_Integer queue = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 4096;
+    lua_getfield(L, opts, "io_uring");
+    if (lua_isboolean(L, -1)) {
+        io_uring_enabled.store(lua_toboolean(L, -1), std::memory_order_relaxed);
+    }
+    lua_pop(L, 3);
+
+    if (threads <= 0 || queue <= 0) {
+        return luaL_error(L, "configure_io: threads and queue must be positive");
+    }
+
+    io_pool.configure(static_cast<size_t>(threads), static_cast<size_t>(queue));
     lua_pushboolean(L, 1);
     return 1;
 }
 
-// file operation functions
-
-// Global mutex to protect Lua state access from multiple threads
-// IMPORTANT: In a real application, you might want a more sophisticated
-// threading model or use Lua's built-in coroutines for asynchronous operations
-// if direct OS threads are not strictly necessary or if you need to
-// avoid locking the entire Lua state for extended periods.
-// static std::mutex lua_mutex;
+// Lua callable function returning pool counters
+// Expected usage: local stats = app:io_stats() -- queue_depth, in_flight, avg_wait_ms, ...
+int uw_io_stats(lua_State *L) {
+    io_pool.push_stats(L);
+#ifdef UWS_LUA_HAVE_IO_URING
+    IoUringBackend *ring = io_uring_probed ? io_uring_backend.get() : nullptr;
+    lua_pushboolean(L, ring != nullptr && io_uring_enabled.load(std::memory_order_relaxed));
+    lua_setfield(L, -2, "io_uring");
+    lua_pushinteger(L, ring ? ring->in_flight() : 0);
+    lua_setfield(L, -2, "io_uring_in_flight");
+#else
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "io_uring");
+#endif
+    return 1;
+}
+
+// Blocking helpers run on pool threads. They only touch their arguments.
+static std::string read_whole_file(const std::string& path, std::string& error_message) {
+    std::string content;
+
+    // Use std::ios::ate to seek to the end and get file size, then seek back
+    // This is a common way to pre-allocate buffer for efficiency with known file size.
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+    if (file.is_open()) {
+        std::streampos file_size = file.tellg(); // Get file size
+        file.seekg(0, std::ios::beg); // Seek back to beginning
+
+        try {
+            content.reserve(file_size); // Pre-allocate memory
+            content.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        } catch (const std::bad_alloc& e) {
+            error_message = "Memory allocation failed for file content: " + std::string(e.what());
+        } catch (const std::exception& e) {
+            error_message = "Error reading file content: " + std::string(e.what());
+        }
+
+        file.close(); // Explicitly close the file
+    } else {
+        error_message = "Failed to open file for reading: " + path;
+    }
+    return content;
+}
+
+static bool write_whole_file(const std::string& path, const std::string& data, std::string& error_message) {
+    bool success = false;
+
+    // Open file for writing in binary mode, truncating existing content
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    if (file.is_open()) {
+        try {
+            file.write(data.data(), data.size());
+            if (file.good()) {
+                success = true; // Check if the write operation was successful
+            } else {
+                error_message = "Error writing data to file: " + path;
+            }
+        } catch (const std::exception& e) {
+            error_message = "Exception during file write: " + std::string(e.what());
+        }
+        file.close(); // Explicitly close the file
+    } else {
+        error_message = "Failed to open file for writing: " + path;
+    }
+    return success;
+}
+
+// Reads a whole file and calls `done` on this loop thread. Uses the loop's io_uring
+// when available and the I/O pool otherwise. Returns false if neither accepted it.
+static bool submit_ring_read(const std::string& path, FileReadDone& done) {
+#ifdef UWS_LUA_HAVE_IO_URING
+    if (IoUringBackend *ring = get_io_uring()) {
+        return ring->read_file(path, done);
+    }
+#endif
+    return false;
+}
+
+static bool submit_file_read(const std::string& path, FileReadDone&& done) {
+    if (submit_ring_read(path, done)) return true;
+
+    std::shared_ptr<CompletionQueue> queue = get_completion_queue();
+    return io_pool.submit([path, done = std::move(done), queue]() mutable {
+        std::string error_message;
+        std::string content = read_whole_file(path, error_message);
+
+        queue->post([done = std::move(done), content = std::move(content),
+                     error_message = std::move(error_message)](lua_State *) mutable {
+            done(content, error_message);
+        });
+    });
+}
+
+// Writes (truncating) a whole file and calls `done` on this loop thread
+static bool submit_file_write(const std::string& path, std::string&& data, FileWriteDone&& done) {
+#ifdef UWS_LUA_HAVE_IO_URING
+    if (IoUringBackend *ring = get_io_uring()) {
+        if (ring->write_file(path, data, done)) return true;
+    }
+#endif
+    std::shared_ptr<CompletionQueue> queue = get_completion_queue();
+    return io_pool.submit([path, data = std::move(data), done = std::move(done), queue]() mutable {
+        std::string error_message;
+        bool success = write_whole_file(path, data, error_message);
 
-// Pointer to the main Lua state. This should be set once at initialization.
-// Ensure main_L is valid and accessible from the worker threads.
-// For example, you might set it in your Lua initialization function:
-// extern lua_State* main_L; // Declare it somewhere accessible
-// lua_State* main_L = nullptr; // Initialize it appropriately
+        queue->post([done = std::move(done), success, error_message = std::move(error_message)](lua_State *) mutable {
+            done(success, error_message);
+        });
+    });
+}
 
 // Helper function to push error messages to Lua
 static void push_error_to_lua(lua_State* L, const std::string& message) {
@@ -1437,140 +4659,95 @@ static void push_bool_result_to_lua(lua_State* L, bool success) {
     lua_pushnil(L); // No error message initially
 }
 
-// file operation functions
-
-int uw_async_read_file(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+// Loop-thread side of a finished read: invoke callback(content, nil) or callback(nil, err)
+static void deliver_read_result(lua_State *L, int cb_ref, const std::string& content, const std::string& error_message) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref); // Push the callback function onto the stack
 
-    lua_pushvalue(L, 2); // Push the callback function
-    int cb_ref = luaL_ref(L, LUA_REGISTRYINDEX); // Store a reference to the callback
+    if (error_message.empty()) {
+        push_success_to_lua(L, content);
+    } else {
+        push_error_to_lua(L, error_message);
+    }
 
-    // Create copies of data needed in the thread to avoid dangling pointers
-    std::string path_copy = path;
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        std::cerr << "Async read callback error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1); // Pop the error message from the stack
+    }
 
-    // Detach the thread to run independently.
-    // Consider using a thread pool or managing threads if you expect many concurrent operations
-    // to avoid resource exhaustion from too many detached threads.
-    std::thread([path_copy, cb_ref]() {
-        std::string content;
-        std::string error_message; // To store any error during file operation
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_ref); // Release the callback reference
+}
 
-        // Use std::ios::ate to seek to the end and get file size, then seek back
-        // This is a common way to pre-allocate buffer for efficiency with known file size.
-        // Or simply read byte by byte if file size is unknown or can be very large.
-        std::ifstream file(path_copy, std::ios::binary | std::ios::ate);
+// Loop-thread side of a finished write: invoke callback(true, nil) or callback(false, err)
+static void deliver_write_result(lua_State *L, int cb_ref, bool success, const std::string& error_message) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref); // Push the callback function onto the stack
 
-        if (file.is_open()) {
-            std::streampos file_size = file.tellg(); // Get file size
-            file.seekg(0, std::ios::beg); // Seek back to beginning
+    if (error_message.empty()) {
+        push_bool_result_to_lua(L, success);
+    } else {
+        lua_pushboolean(L, false); // Indicate failure
+        lua_pushstring(L, error_message.c_str());
+    }
 
-            // Read the entire file content into the string
-            // For very large files, consider reading in chunks to avoid excessive memory usage.
-            try {
-                content.reserve(file_size); // Pre-allocate memory
-                content.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-            } catch (const std::bad_alloc& e) {
-                error_message = "Memory allocation failed for file content: " + std::string(e.what());
-            } catch (const std::exception& e) {
-                error_message = "Error reading file content: " + std::string(e.what());
-            }
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        std::cerr << "Async write callback error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1); // Pop the error message from the stack
+    }
 
-            file.close(); // Explicitly close the file
-        } else {
-            error_message = "Failed to open file for reading: " + path_copy;
-        }
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_ref); // Release the callback reference
+}
 
-        // Acquire lock before interacting with the Lua state
-        std::lock_guard<std::mutex> lock(lua_mutex);
+// file operation functions
 
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, cb_ref); // Push the callback function onto the stack
+// Lua Usage: ok, err = app:async_read_file(path, function(content, err) ... end)
+// Returns true once queued, or false and a message when the I/O queue is full.
+int uw_async_read_file(lua_State *L) {
+    int arg = first_arg_index(L);
+    const char *path = luaL_checkstring(L, arg);
+    luaL_checktype(L, arg + 1, LUA_TFUNCTION);
 
-        // Push results based on whether an error occurred
-        if (error_message.empty()) {
-            // Success: push content and nil for error
-            lua_pushlstring(main_L, content.data(), content.size());
-            lua_pushnil(main_L); // No error
-        } else {
-            // Error: push nil for content and error message
-            lua_pushnil(main_L);
-            lua_pushstring(main_L, error_message.c_str());
-        }
+    lua_pushvalue(L, arg + 1); // Push the callback function
+    int cb_ref = luaL_ref(L, LUA_REGISTRYINDEX); // Store a reference to the callback
 
-        // Call the Lua callback function with 2 return values (content/nil, nil/error_message)
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) { // 2 arguments, 0 results, no error handler func
-            std::cerr << "Async read callback error: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1); // Pop the error message from the stack
-        }
+    bool queued = submit_file_read(path, [cb_ref](std::string& content, const std::string& error_message) {
+        deliver_read_result(main_L, cb_ref, content, error_message);
+    });
 
-        luaL_unref(main_L, LUA_REGISTRYINDEX, cb_ref); // Release the callback reference
-    }).detach();
+    if (!queued) {
+        luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "I/O queue is full");
+        return 2;
+    }
 
-    return 0; // Lua function returns 0 results
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
+// Lua Usage: ok, err = app:async_write_file(path, data, function(success, err) ... end)
+// Returns true once queued, or false and a message when the I/O queue is full.
 int uw_async_write_file(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
+    int arg = first_arg_index(L);
+    const char *path = luaL_checkstring(L, arg);
     size_t len;
-    const char *data = luaL_checklstring(L, 2, &len);
-    luaL_checktype(L, 3, LUA_TFUNCTION);
+    const char *data = luaL_checklstring(L, arg + 1, &len);
+    luaL_checktype(L, arg + 2, LUA_TFUNCTION);
 
-    lua_pushvalue(L, 3); // Push the callback function
+    lua_pushvalue(L, arg + 2); // Push the callback function
     int cb_ref = luaL_ref(L, LUA_REGISTRYINDEX); // Store a reference to the callback
 
-    // Create copies of data needed in the thread to avoid dangling pointers
-    std::string path_copy = path;
-    std::string data_copy(data, len); // Create a copy of the data
-
-    std::thread([path_copy, data_copy, cb_ref]() {
-        bool success = false;
-        std::string error_message; // To store any error during file operation
-
-        // Open file for writing in binary mode, truncating existing content
-        std::ofstream file(path_copy, std::ios::binary | std::ios::trunc);
-
-        if (file.is_open()) {
-            try {
-                file.write(data_copy.data(), data_copy.size());
-                if (file.good()) {
-                    success = true; // Check if the write operation was successful
-                } else {
-                    error_message = "Error writing data to file: " + path_copy;
-                }
-            } catch (const std::exception& e) {
-                error_message = "Exception during file write: " + std::string(e.what());
-            }
-            file.close(); // Explicitly close the file
-        } else {
-            error_message = "Failed to open file for writing: " + path_copy;
-        }
-
-        // Acquire lock before interacting with the Lua state
-        std::lock_guard<std::mutex> lock(lua_mutex);
-
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, cb_ref); // Push the callback function onto the stack
-
-        // Push results based on whether an error occurred
-        if (error_message.empty()) {
-            // Success: push true and nil for error
-            lua_pushboolean(main_L, success);
-            lua_pushnil(main_L); // No error
-        } else {
-            // Error: push false for success status and error message
-            lua_pushboolean(main_L, false); // Indicate failure
-            lua_pushstring(main_L, error_message.c_str());
-        }
-
-        // Call the Lua callback function with 2 return values (success_bool, nil/error_message)
-        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) { // 2 arguments, 0 results, no error handler func
-            std::cerr << "Async write callback error: " << lua_tostring(main_L, -1) << std::endl;
-            lua_pop(main_L, 1); // Pop the error message from the stack
-        }
+    bool queued = submit_file_write(path, std::string(data, len), [cb_ref](bool success, const std::string& error_message) {
+        deliver_write_result(main_L, cb_ref, success, error_message);
+    });
 
-        luaL_unref(main_L, LUA_REGISTRYINDEX, cb_ref); // Release the callback reference
-    }).detach();
+    if (!queued) {
+        luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "I/O queue is full");
+        return 2;
+    }
 
-    return 0; // Lua function returns 0 results
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 // --- Synchronous File Operations ---
@@ -1667,126 +4844,260 @@ int uw_sync_write_file(lua_State *L) {
 }
 
 
-// Add near top with other declarations
+// Timers live in active_timers by id; a binary min-heap orders their deadlines and one
+// us_timer is armed for the nearest, so nothing runs between deadlines and an idle loop
+// still wakes up on time. Inserts are O(log n). Clearing only drops the map entry: the
+// heap entry goes stale and is skipped when it surfaces, and the heap is rebuilt once
+// stale entries outnumber live ones, so cancel-heavy workloads stay bounded.
+// Everything here is per thread and only touched from that thread's loop.
+//
+// Callbacks and their arguments live in one registry table, timers[id] = { fn, ..., n = nargs },
+// and all timers due in an iteration are handed to a small Lua dispatcher in one call.
 struct LuaTimer {
+    // What an interval does when it falls behind by one or more periods
+    enum Policy {
+        SKIP,    // Drop the missed ticks and stay on the original phase (default)
+        CATCHUP, // Fire every missed tick, one per iteration, until back on schedule
+        DELAY,   // Next run is one interval after this one finished (the old behavior)
+    };
+
     int timer_id;
     bool is_interval;
-    int callback_ref;
-    std::vector<int> arg_refs;
-    bool active;
+    Policy policy = SKIP;
     std::chrono::milliseconds interval;
     std::chrono::steady_clock::time_point next_execution;
 };
 
-static std::unordered_map<int, LuaTimer> active_timers;
-static std::mutex timers_mutex;
-static int next_timer_id = 1;
-static void* timer_handler_key = nullptr;
-static bool timers_initialized = false;
-static int cleanup_callback_ref = LUA_NOREF;
-
-// Helper to call Lua timer callbacks
-static void call_timer_callback(int timer_id) {
-    std::lock_guard<std::mutex> lua_lock(lua_mutex);
-    std::lock_guard<std::mutex> timer_lock(timers_mutex);
-    
-    auto it = active_timers.find(timer_id);
-    if (it == active_timers.end() || !it->second.active) {
-        return;
+struct TimerHeapEntry {
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t sequence; // Timers due at the same instant fire in scheduling order
+    int timer_id;
+
+    bool operator>(const TimerHeapEntry& other) const {
+        return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
     }
-    
-    LuaTimer& timer = it->second;
-    
-    lua_rawgeti(main_L, LUA_REGISTRYINDEX, timer.callback_ref);
-    
-    for (int arg_ref : timer.arg_refs) {
-        lua_rawgeti(main_L, LUA_REGISTRYINDEX, arg_ref);
+};
+
+static thread_local std::unordered_map<int, LuaTimer> active_timers;
+static thread_local std::vector<TimerHeapEntry> timer_heap;
+static thread_local std::vector<TimerHeapEntry> timers_due; // Reused between iterations
+static thread_local uint64_t timer_sequence = 0;
+static thread_local int next_timer_id = 1;
+static thread_local us_timer_t *timer_wakeup = nullptr;
+static thread_local bool timer_wakeup_armed = false;
+static thread_local std::chrono::steady_clock::time_point timer_wakeup_deadline;
+static thread_local bool timers_initialized = false;
+static thread_local bool timers_running = false;
+static thread_local int timer_table_ref = LUA_NOREF;    // timers[id] = { fn, args..., n = nargs }
+static thread_local int timer_due_ref = LUA_NOREF;      // Array of due ids, reused by every batch
+static thread_local int timer_dispatch_ref = LUA_NOREF; // dispatch(due, count)
+static thread_local int cleanup_callback_ref = LUA_NOREF;
+
+static void run_due_timers();
+
+static void on_timer_wakeup(us_timer_t *) {
+    timer_wakeup_armed = false;
+    run_due_timers();
+}
+
+static int report_timer_error(lua_State *L) {
+    std::cerr << "Timer callback error: " << luaL_optstring(L, 1, "(error object is not a string)") << std::endl;
+    return 0;
+}
+
+// Runs each due timer still present in the table under its own pcall, so one failing
+// callback neither stops the batch nor unwinds into C
+static const char timer_dispatch_source[] =
+    "local timers, report = ...\n"
+    "local pcall, unpack = pcall, unpack or table.unpack\n"
+    "return function(due, count)\n"
+    "  for i = 1, count do\n"
+    "    local timer = timers[due[i]]\n"
+    "    if timer then\n"
+    "      local ok, err = pcall(timer[1], unpack(timer, 2, timer.n))\n"
+    "      if not ok then report(tostring(err)) end\n"
+    "    end\n"
+    "  end\n"
+    "end\n";
+
+static void ensure_timer_tables(lua_State *L) {
+    if (timer_table_ref != LUA_NOREF) return;
+
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    timer_table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_newtable(L);
+    timer_due_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if (luaL_loadbuffer(L, timer_dispatch_source, sizeof(timer_dispatch_source) - 1, "=timer_dispatch") != LUA_OK) {
+        luaL_error(L, "timer dispatcher: %s", lua_tostring(L, -1));
     }
-    
-    if (lua_pcall(main_L, timer.arg_refs.size(), 0, 0) != LUA_OK) {
-        std::cerr << "Timer callback error: " << lua_tostring(main_L, -1) << std::endl;
-        lua_pop(main_L, 1);
+    lua_pushvalue(L, -2);
+    lua_pushcfunction(L, report_timer_error);
+    lua_call(L, 2, 1);
+    timer_dispatch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1); // timers table
+}
+
+// A heap entry is live while its timer exists and is still scheduled for that deadline
+static bool timer_entry_live(const TimerHeapEntry& entry) {
+    auto it = active_timers.find(entry.timer_id);
+    return it != active_timers.end() && it->second.next_execution == entry.deadline;
+}
+
+static void push_timer_deadline(const LuaTimer& timer) {
+    timer_heap.push_back({timer.next_execution, timer_sequence++, timer.timer_id});
+    std::push_heap(timer_heap.begin(), timer_heap.end(), std::greater<TimerHeapEntry>());
+}
+
+static void compact_timer_heap() {
+    timer_heap.erase(std::remove_if(timer_heap.begin(), timer_heap.end(),
+        [](const TimerHeapEntry& entry) { return !timer_entry_live(entry); }), timer_heap.end());
+    std::make_heap(timer_heap.begin(), timer_heap.end(), std::greater<TimerHeapEntry>());
+}
+
+// Points the us_timer at the earliest live deadline, or disarms it
+static void arm_timer_wakeup() {
+    if (!timer_wakeup || timers_running) return;
+
+    while (!timer_heap.empty() && !timer_entry_live(timer_heap.front())) {
+        std::pop_heap(timer_heap.begin(), timer_heap.end(), std::greater<TimerHeapEntry>());
+        timer_heap.pop_back();
     }
-    
-    if (timer.is_interval) {
-        timer.next_execution = std::chrono::steady_clock::now() + timer.interval;
-    } else {
-        timer.active = false;
+    if (timer_heap.empty()) {
+        if (timer_wakeup_armed) us_timer_set(timer_wakeup, on_timer_wakeup, 0, 0);
+        timer_wakeup_armed = false;
+        return;
     }
+
+    auto deadline = timer_heap.front().deadline;
+    if (timer_wakeup_armed && timer_wakeup_deadline == deadline) return;
+
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    // 0 would disarm the timer, so anything already due fires on the next tick
+    us_timer_set(timer_wakeup, on_timer_wakeup, static_cast<int>(std::max<long long>(wait, 1)), 0);
+    timer_wakeup_armed = true;
+    timer_wakeup_deadline = deadline;
 }
 
-// Timer check function
-static void check_timers() {
-    auto now = std::chrono::steady_clock::now();
-    std::vector<int> timers_to_execute;
-    
-    {
-        std::lock_guard<std::mutex> lock(timers_mutex);
-        for (auto& pair : active_timers) {
-            if (pair.second.active && now >= pair.second.next_execution) {
-                timers_to_execute.push_back(pair.first);
+// Drops a timer's callback and arguments from the timers table
+static void release_timer(lua_State *L, int timer_id) {
+    if (timer_table_ref == LUA_NOREF) return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, timer_table_ref);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, timer_id);
+    lua_pop(L, 1);
+}
+
+// Fixed-rate: the next deadline follows from the previous deadline, not from when the
+// callback happened to finish, so intervals do not drift by their own run time
+static void reschedule_interval(LuaTimer& timer, std::chrono::steady_clock::time_point deadline,
+                                std::chrono::steady_clock::time_point now) {
+    auto period = std::max(timer.interval, std::chrono::milliseconds(1));
+    switch (timer.policy) {
+        case LuaTimer::DELAY:
+            timer.next_execution = now + timer.interval;
+            break;
+        case LuaTimer::CATCHUP:
+            timer.next_execution = deadline + period;
+            break;
+        case LuaTimer::SKIP:
+            timer.next_execution = deadline + period;
+            if (timer.next_execution <= now) {
+                auto missed = (now - deadline) / period;
+                timer.next_execution = deadline + (missed + 1) * period;
             }
-        }
+            break;
     }
-    
-    for (int timer_id : timers_to_execute) {
-        call_timer_callback(timer_id);
+    push_timer_deadline(timer);
+}
+
+static void run_due_timers() {
+    auto now = std::chrono::steady_clock::now();
+
+    timers_due.clear();
+    while (!timer_heap.empty() && timer_heap.front().deadline <= now) {
+        TimerHeapEntry entry = timer_heap.front();
+        std::pop_heap(timer_heap.begin(), timer_heap.end(), std::greater<TimerHeapEntry>());
+        timer_heap.pop_back();
+        if (timer_entry_live(entry)) timers_due.push_back(entry);
     }
-    
-    // Clean up inactive timers
-    {
-        std::lock_guard<std::mutex> lock(timers_mutex);
-        for (auto it = active_timers.begin(); it != active_timers.end(); ) {
-            if (!it->second.active) {
-                luaL_unref(main_L, LUA_REGISTRYINDEX, it->second.callback_ref);
-                for (int arg_ref : it->second.arg_refs) {
-                    luaL_unref(main_L, LUA_REGISTRYINDEX, arg_ref);
-                }
-                it = active_timers.erase(it);
+
+    if (!timers_due.empty()) {
+        timers_running = true;
+
+        // One Lua entry for the whole batch
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, timer_dispatch_ref);
+        lua_rawgeti(main_L, LUA_REGISTRYINDEX, timer_due_ref);
+        for (size_t i = 0; i < timers_due.size(); i++) {
+            lua_pushinteger(main_L, timers_due[i].timer_id);
+            lua_rawseti(main_L, -2, static_cast<int>(i + 1));
+        }
+        lua_pushinteger(main_L, static_cast<lua_Integer>(timers_due.size()));
+        if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
+            std::cerr << "Timer dispatch error: " << lua_tostring(main_L, -1) << std::endl;
+            lua_pop(main_L, 1);
+        }
+
+        // Callbacks may have cleared or replaced any of these; only untouched ones move on
+        auto finished = std::chrono::steady_clock::now();
+        for (const auto& entry : timers_due) {
+            auto it = active_timers.find(entry.timer_id);
+            if (it == active_timers.end() || it->second.next_execution != entry.deadline) continue;
+            if (it->second.is_interval) {
+                reschedule_interval(it->second, entry.deadline, finished);
             } else {
-                ++it;
+                release_timer(main_L, entry.timer_id);
+                active_timers.erase(it);
             }
         }
+        timers_running = false;
     }
+
+    if (timer_heap.size() > 64 && timer_heap.size() > 2 * active_timers.size()) {
+        compact_timer_heap();
+    }
+    arm_timer_wakeup();
 }
 
 // Initialize timer system
 static void init_timer_system() {
     if (!timers_initialized && uWS::Loop::get()) {
-        timer_handler_key = new int(0);
-        uWS::Loop::get()->addPostHandler(timer_handler_key, [](uWS::Loop* loop) {
-            check_timers();
-        });
+        // Fallthrough: like the sockets' own timeouts, a pending timer does not keep run() alive
+        timer_wakeup = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 1, 0);
+        timer_wakeup_armed = false;
         timers_initialized = true;
+        arm_timer_wakeup();
     }
 }
 
 // Shutdown timer system
 static void shutdown_timer_system() {
     if (timers_initialized) {
-        if (uWS::Loop::get() && timer_handler_key) {
-            uWS::Loop::get()->removePostHandler(timer_handler_key);
+        if (timer_wakeup) {
+            us_timer_close(timer_wakeup);
+            timer_wakeup = nullptr;
         }
-        
-        // Clean up any remaining timers
-        {
-            std::lock_guard<std::mutex> lock(timers_mutex);
-            for (auto& pair : active_timers) {
-                luaL_unref(main_L, LUA_REGISTRYINDEX, pair.second.callback_ref);
-                for (int arg_ref : pair.second.arg_refs) {
-                    luaL_unref(main_L, LUA_REGISTRYINDEX, arg_ref);
-                }
-            }
-            active_timers.clear();
+        timer_wakeup_armed = false;
+
+        // Clean up any remaining timers; dropping the table releases every callback and argument
+        active_timers.clear();
+        timer_heap.clear();
+        if (timer_table_ref != LUA_NOREF) {
+            luaL_unref(main_L, LUA_REGISTRYINDEX, timer_table_ref);
+            luaL_unref(main_L, LUA_REGISTRYINDEX, timer_due_ref);
+            luaL_unref(main_L, LUA_REGISTRYINDEX, timer_dispatch_ref);
+            timer_table_ref = timer_due_ref = timer_dispatch_ref = LUA_NOREF;
         }
-        
-        delete static_cast<int*>(timer_handler_key);
-        timer_handler_key = nullptr;
+
         timers_initialized = false;
     }
 }
 
 // Common function to create timers
+// Expected usage: app.setTimeout(fn, ms, ...), app.setInterval(fn, ms, ...), or for
+// intervals app.setInterval(fn, { interval = ms, policy = "skip" | "catchup" | "delay" }, ...)
 static int create_timer(lua_State* L, bool is_interval) {
     if (!app) {
         luaL_error(L, "uWS::App not initialized. Call create_app first.");
@@ -1794,36 +5105,62 @@ static int create_timer(lua_State* L, bool is_interval) {
     }
     
     luaL_checktype(L, 1, LUA_TFUNCTION);
-    int delay = luaL_checkinteger(L, 2);
-    
-    lua_pushvalue(L, 1);
-    int callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    
-    std::vector<int> arg_refs;
-    int num_args = lua_gettop(L);
-    for (int i = 3; i <= num_args; i++) {
-        lua_pushvalue(L, i);
-        arg_refs.push_back(luaL_ref(L, LUA_REGISTRYINDEX));
+    LuaTimer::Policy policy = LuaTimer::SKIP;
+    int delay;
+    if (is_interval && lua_istable(L, 2)) {
+        lua_getfield(L, 2, "interval");
+        delay = static_cast<int>(luaL_checkinteger(L, -1));
+        lua_getfield(L, 2, "policy");
+        if (lua_isstring(L, -1)) {
+            const char *name = lua_tostring(L, -1);
+            if (strcmp(name, "skip") == 0) {
+                policy = LuaTimer::SKIP;
+            } else if (strcmp(name, "catchup") == 0) {
+                policy = LuaTimer::CATCHUP;
+            } else if (strcmp(name, "delay") == 0) {
+                policy = LuaTimer::DELAY;
+            } else {
+                luaL_argerror(L, 2, "policy must be \"skip\", \"catchup\" or \"delay\"");
+            }
+        }
+        lua_pop(L, 2);
+    } else {
+        delay = luaL_checkinteger(L, 2);
     }
+    if (delay < 0) delay = 0;
+    
+    ensure_timer_tables(L);
     
     LuaTimer timer;
     timer.timer_id = next_timer_id++;
     timer.is_interval = is_interval;
-    timer.callback_ref = callback_ref;
-    timer.arg_refs = std::move(arg_refs);
-    timer.active = true;
+    timer.policy = policy;
     timer.interval = std::chrono::milliseconds(delay);
     timer.next_execution = std::chrono::steady_clock::now() + timer.interval;
     
-    {
-        std::lock_guard<std::mutex> lock(timers_mutex);
-        active_timers[timer.timer_id] = timer;
+    // timers[id] = { fn, args..., n = nargs }
+    int num_args = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, timer_table_ref);
+    lua_createtable(L, num_args - 1, 1);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    for (int i = 3; i <= num_args; i++) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - 1);
     }
+    lua_pushinteger(L, num_args - 1);
+    lua_setfield(L, -2, "n");
+    lua_rawseti(L, -2, timer.timer_id);
+    lua_pop(L, 1);
+    
+    LuaTimer& stored = active_timers.emplace(timer.timer_id, timer).first->second;
+    push_timer_deadline(stored);
     
     // Ensure timer system is initialized
     init_timer_system();
+    arm_timer_wakeup();
     
-    lua_pushinteger(L, timer.timer_id);
+    lua_pushinteger(L, stored.timer_id);
     return 1;
 }
 
@@ -1831,10 +5168,15 @@ static int create_timer(lua_State* L, bool is_interval) {
 static int clear_timer(lua_State* L) {
     int timer_id = luaL_checkinteger(L, 1);
     
-    std::lock_guard<std::mutex> lock(timers_mutex);
     auto it = active_timers.find(timer_id);
     if (it != active_timers.end()) {
-        it->second.active = false;
+        active_timers.erase(it);
+        release_timer(L, timer_id);
+        // Its heap entry is now stale; rebuild once those dominate
+        if (timer_heap.size() > 64 && timer_heap.size() > 2 * active_timers.size()) {
+            compact_timer_heap();
+        }
+        arm_timer_wakeup();
     }
     
     return 0;
@@ -1853,6 +5195,297 @@ int uw_clearTimer(lua_State *L) {
     return clear_timer(L);
 }
 
+// Deferred work: app.defer(fn, ...) runs fn(...) on the next loop iteration, in order,
+// without touching the timer heap. Callbacks sit in two Lua arrays (functions and packed
+// arguments) indexed first..last; the queue rewinds to index 1 whenever it drains, so
+// the same array slots are reused like a ring. One Loop::defer wakes the loop per batch
+// and the whole batch runs in a single Lua call. Work deferred while a batch runs goes
+// to the next iteration, so long fan-out jobs can yield to I/O between slices.
+static thread_local int defer_fns_ref = LUA_NOREF;
+static thread_local int defer_args_ref = LUA_NOREF;
+static thread_local int defer_drain_ref = LUA_NOREF;
+static thread_local lua_Integer defer_first = 1; // Next slot to run
+static thread_local lua_Integer defer_last = 0;  // Last queued slot
+static thread_local bool defer_scheduled = false;
+
+// Runs slots first..last under one pcall each and clears them as it goes
+static const char defer_drain_source[] =
+    "local fns, args, report = ...\n"
+    "local pcall, unpack = pcall, unpack or table.unpack\n"
+    "return function(first, last)\n"
+    "  for i = first, last do\n"
+    "    local fn, packed = fns[i], args[i]\n"
+    "    fns[i] = nil\n"
+    "    args[i] = nil\n"
+    "    local ok, err\n"
+    "    if packed then ok, err = pcall(fn, unpack(packed, 1, packed.n)) else ok, err = pcall(fn) end\n"
+    "    if not ok then report(tostring(err)) end\n"
+    "  end\n"
+    "end\n";
+
+static int report_defer_error(lua_State *L) {
+    std::cerr << "Deferred callback error: " << luaL_optstring(L, 1, "(error object is not a string)") << std::endl;
+    return 0;
+}
+
+static void drain_deferred();
+
+static void schedule_defer_drain() {
+    if (defer_scheduled) return;
+    defer_scheduled = true;
+    uWS::Loop::get()->defer([]() {
+        drain_deferred();
+    });
+}
+
+static void drain_deferred() {
+    defer_scheduled = false;
+    if (defer_first > defer_last || !main_L) return;
+
+    // Only what is queued now; anything deferred from inside runs next iteration
+    lua_Integer first = defer_first, last = defer_last;
+    defer_first = last + 1;
+
+    lua_rawgeti(main_L, LUA_REGISTRYINDEX, defer_drain_ref);
+    lua_pushinteger(main_L, first);
+    lua_pushinteger(main_L, last);
+    if (lua_pcall(main_L, 2, 0, 0) != LUA_OK) {
+        std::cerr << "Deferred dispatch error: " << lua_tostring(main_L, -1) << std::endl;
+        lua_pop(main_L, 1);
+    }
+
+    if (defer_first > defer_last) {
+        defer_first = 1;
+        defer_last = 0;
+    } else {
+        schedule_defer_drain();
+    }
+}
+
+static void ensure_defer_queue(lua_State *L) {
+    if (defer_drain_ref != LUA_NOREF) return;
+
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    defer_fns_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    defer_args_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if (luaL_loadbuffer(L, defer_drain_source, sizeof(defer_drain_source) - 1, "=defer_drain") != LUA_OK) {
+        luaL_error(L, "defer dispatcher: %s", lua_tostring(L, -1));
+    }
+    lua_insert(L, -3);
+    lua_pushcfunction(L, report_defer_error);
+    lua_call(L, 3, 1);
+    defer_drain_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Lua Usage: app.defer(fn, ...) / app:setImmediate(fn, ...)
+int uw_defer(lua_State *L) {
+    int arg = first_arg_index(L);
+    luaL_checktype(L, arg, LUA_TFUNCTION);
+    ensure_defer_queue(L);
+
+    lua_Integer slot = ++defer_last;
+    int top = lua_gettop(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, defer_fns_ref);
+    lua_pushvalue(L, arg);
+    lua_rawseti(L, -2, static_cast<int>(slot));
+    lua_pop(L, 1);
+
+    // Arguments are packed only when there are any, so the common fn-only case allocates nothing
+    if (top > arg) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, defer_args_ref);
+        lua_createtable(L, top - arg, 1);
+        for (int i = arg + 1; i <= top; i++) {
+            lua_pushvalue(L, i);
+            lua_rawseti(L, -2, i - arg);
+        }
+        lua_pushinteger(L, top - arg);
+        lua_setfield(L, -2, "n");
+        lua_rawseti(L, -2, static_cast<int>(slot));
+        lua_pop(L, 1);
+    }
+
+    schedule_defer_drain();
+    return 0;
+}
+
+// The async handler running on L; raises a Lua error outside of one
+static std::shared_ptr<AsyncRequest> check_async_context(lua_State *L) {
+    auto it = async_by_thread.find(L);
+    if (it == async_by_thread.end()) {
+        luaL_error(L, "await is only available inside async route handlers ({ async = true })");
+    }
+    if (it->second->aborted) {
+        luaL_error(L, "request aborted");
+    }
+    // Awaiting after the response was sent is fine, but the response is gone by the resume
+    AsyncRequest& ctx = *it->second;
+    if (ctx.res && ctx.res->hasResponded()) detach_async_response(ctx);
+    return it->second;
+}
+
+static uint64_t begin_async_wait(const std::shared_ptr<AsyncRequest>& ctx) {
+    uint64_t token = ++async_wait_counter;
+    ctx->wait_token = token;
+    async_waiting[token] = ctx;
+    return token;
+}
+
+// Loop-thread completion of an await: push_results pushes the await's return values
+static void finish_async_wait(uint64_t token, const std::function<int(lua_State*)>& push_results) {
+    auto it = async_waiting.find(token);
+    if (it == async_waiting.end()) return; // Cancelled
+    std::shared_ptr<AsyncRequest> ctx = it->second;
+    async_waiting.erase(it);
+    ctx->wait_token = 0;
+    if (!ctx->co) return; // Handler already finished
+
+    if (ctx->running) {
+        // Completed before the handler yielded: keep the results for await to return
+        lua_State *L = ctx->co;
+        int base = lua_gettop(L);
+        int n = push_results(L);
+        lua_createtable(L, n, 1);
+        for (int i = n; i >= 1; i--) {
+            lua_pushvalue(L, base + i);
+            lua_rawseti(L, -2, i);
+        }
+        lua_pushinteger(L, n);
+        lua_setfield(L, -2, "n");
+        ctx->early_result_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_settop(L, base);
+        return;
+    }
+
+    if (!ctx->res) {
+        int n = push_results(ctx->co);
+        step_async_request(ctx, n);
+        return;
+    }
+    // Writes from outside a uWS callback are corked into one send
+    ctx->res->cork([&]() {
+        int n = push_results(ctx->co);
+        step_async_request(ctx, n);
+    });
+}
+
+// Returns the await's results: already delivered ones, or whatever resumes the yield
+static int complete_async_wait(lua_State *L, const std::shared_ptr<AsyncRequest>& ctx) {
+    if (ctx->early_result_ref != LUA_NOREF) {
+        int ref = ctx->early_result_ref;
+        ctx->early_result_ref = LUA_NOREF;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        lua_getfield(L, -1, "n");
+        int n = static_cast<int>(lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        int table = lua_gettop(L);
+        for (int i = 1; i <= n; i++) lua_rawgeti(L, table, i);
+        lua_remove(L, table);
+        return n;
+    }
+    return lua_yield(L, 0);
+}
+
+// resume(...) handed to app.await's starter; upvalue 1 is the wait token
+static int async_resume(lua_State *L) {
+    uint64_t token = static_cast<uint64_t>(lua_tonumber(L, lua_upvalueindex(1)));
+    int n = lua_gettop(L);
+    finish_async_wait(token, [L, n](lua_State *co) {
+        for (int i = 1; i <= n; i++) lua_pushvalue(L, i);
+        if (co != L) lua_xmove(L, co, n);
+        return n;
+    });
+    return 0;
+}
+
+// Lua Usage: local a, b = app.await(function(resume) start_something(function(...) resume(...) end) end)
+// Works with any callback-style API; resume's arguments become await's results.
+int uw_await(lua_State *L) {
+    auto ctx = check_async_context(L);
+    int arg = first_arg_index(L);
+    luaL_checktype(L, arg, LUA_TFUNCTION);
+
+    uint64_t token = begin_async_wait(ctx);
+    lua_pushvalue(L, arg);
+    lua_pushnumber(L, static_cast<lua_Number>(token));
+    lua_pushcclosure(L, async_resume, 1);
+    lua_call(L, 1, 0);
+    lua_settop(L, 0);
+    return complete_async_wait(L, ctx);
+}
+
+// Lua Usage: app.sleep(ms) inside an async handler
+int uw_sleep(lua_State *L) {
+    auto ctx = check_async_context(L);
+    lua_Integer ms = luaL_checkinteger(L, first_arg_index(L));
+
+    uint64_t token = begin_async_wait(ctx);
+    lua_settop(L, 0);
+    lua_pushnumber(L, static_cast<lua_Number>(token));
+    lua_pushcclosure(L, async_resume, 1);
+    lua_pushinteger(L, ms);
+    create_timer(L, false);
+    lua_settop(L, 0);
+    return complete_async_wait(L, ctx);
+}
+
+// Lua Usage: local content, err = app.await_read_file(path) inside an async handler
+int uw_await_read_file(lua_State *L) {
+    auto ctx = check_async_context(L);
+    std::string path = luaL_checkstring(L, first_arg_index(L));
+
+    uint64_t token = begin_async_wait(ctx);
+    bool queued = submit_file_read(path, [token](std::string& content, const std::string& error_message) {
+        finish_async_wait(token, [&](lua_State *co) {
+            if (error_message.empty()) push_success_to_lua(co, content);
+            else push_error_to_lua(co, error_message);
+            return 2;
+        });
+    });
+    if (!queued) {
+        async_waiting.erase(token);
+        ctx->wait_token = 0;
+        lua_pushnil(L);
+        lua_pushstring(L, "I/O queue is full");
+        return 2;
+    }
+    lua_settop(L, 0);
+    return complete_async_wait(L, ctx);
+}
+
+// Lua Usage: local ok, err = app.await_write_file(path, data) inside an async handler
+int uw_await_write_file(lua_State *L) {
+    auto ctx = check_async_context(L);
+    int arg = first_arg_index(L);
+    std::string path = luaL_checkstring(L, arg);
+    size_t len;
+    const char *data = luaL_checklstring(L, arg + 1, &len);
+
+    uint64_t token = begin_async_wait(ctx);
+    bool queued = submit_file_write(path, std::string(data, len), [token](bool success, const std::string& error_message) {
+        finish_async_wait(token, [&](lua_State *co) {
+            lua_pushboolean(co, success && error_message.empty());
+            if (error_message.empty()) lua_pushnil(co);
+            else lua_pushstring(co, error_message.c_str());
+            return 2;
+        });
+    });
+    if (!queued) {
+        async_waiting.erase(token);
+        ctx->wait_token = 0;
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "I/O queue is full");
+        return 2;
+    }
+    lua_settop(L, 0);
+    return complete_async_wait(L, ctx);
+}
+
 int uw_cleanup_app(lua_State *L) {
     std::cout << "Cleaning up the uWS app instance..." << std::endl;
 
@@ -1866,6 +5499,8 @@ int uw_cleanup_app(lua_State *L) {
     // Destroy the uWS::App instance
     if (app) {
         app.reset();
+        websocket_registry.clear();
+        clear_websocket_batches();
         std::cout << "🗑️ uWS::App destroyed" << std::endl;
     }
 
@@ -1921,6 +5556,9 @@ int uw_run(lua_State *L) {
     
     // Clean up everything
     shutdown_timer_system();
+#ifdef UWS_LUA_HAVE_IO_URING
+    shutdown_io_uring();
+#endif
     if (app) {
         app.reset();
     }
@@ -1937,7 +5575,6 @@ int uw_listen(lua_State *L) {
     int port = luaL_checkinteger(L, 1);
 
     app->listen(port, [L, port](auto *token) {
-        std::lock_guard<std::mutex> lock(lua_mutex);
         listen_socket = token;
 
         if (token) {
@@ -1973,8 +5610,13 @@ int uw_restart_cleanup(lua_State *L) {
                     conn->res->end();
                     conn->is_aborted = true;
                 }
+                if (conn) conn->channels.clear();
             }
             active_sse_connections.clear();
+            // Channels stay valid for routes and handles that refer to them, just empty
+            for (auto &p : sse_channels) {
+                p.second->subscribers.clear();
+            }
         }
 
         if (listen_socket) {
@@ -1985,6 +5627,8 @@ int uw_restart_cleanup(lua_State *L) {
         if (app) {
             app.reset();
         }
+        websocket_registry.clear();
+        clear_websocket_batches();
     });
 
     return 0; // tell Lua "no return values"
@@ -2015,13 +5659,29 @@ static void create_app_metatable(lua_State *L) {
     lua_pushcfunction(L, uw_sse);           lua_setfield(L, -2, "sse");
     lua_pushcfunction(L, uw_sse_send);      lua_setfield(L, -2, "sse_send");
     lua_pushcfunction(L, uw_sse_close);     lua_setfield(L, -2, "sse_close");
+    lua_pushcfunction(L, uw_sse_channel);   lua_setfield(L, -2, "sse_channel");
+    lua_pushcfunction(L, uw_sse_subscribe); lua_setfield(L, -2, "sse_subscribe");
+    lua_pushcfunction(L, uw_sse_unsubscribe); lua_setfield(L, -2, "sse_unsubscribe");
+    lua_pushcfunction(L, uw_sse_publish);   lua_setfield(L, -2, "sse_publish");
 
     lua_pushcfunction(L, uw_use);           lua_setfield(L, -2, "use");
     lua_pushcfunction(L, uw_serve_static);  lua_setfield(L, -2, "serve_static");
+    lua_pushcfunction(L, uw_publish);       lua_setfield(L, -2, "publish");
+    lua_pushcfunction(L, uw_num_subscribers); lua_setfield(L, -2, "num_subscribers");
+    lua_pushcfunction(L, uw_ws_send);       lua_setfield(L, -2, "ws_send");
+    lua_pushcfunction(L, uw_ws_close);      lua_setfield(L, -2, "ws_close");
+    lua_pushcfunction(L, uw_ws_count);      lua_setfield(L, -2, "ws_count");
+    lua_pushcfunction(L, uw_ws_each);       lua_setfield(L, -2, "ws_each");
 
     lua_pushcfunction(L, uw_setTimeout);    lua_setfield(L, -2, "setTimeout");
     lua_pushcfunction(L, uw_setInterval);   lua_setfield(L, -2, "setInterval");
     lua_pushcfunction(L, uw_clearTimer);    lua_setfield(L, -2, "clearTimer");
+    lua_pushcfunction(L, uw_defer);         lua_setfield(L, -2, "defer");
+    lua_pushcfunction(L, uw_defer);         lua_setfield(L, -2, "setImmediate");
+    lua_pushcfunction(L, uw_await);         lua_setfield(L, -2, "await");
+    lua_pushcfunction(L, uw_sleep);         lua_setfield(L, -2, "sleep");
+    lua_pushcfunction(L, uw_await_read_file);  lua_setfield(L, -2, "await_read_file");
+    lua_pushcfunction(L, uw_await_write_file); lua_setfield(L, -2, "await_write_file");
 
     lua_pushcfunction(L, uw_listen);        lua_setfield(L, -2, "listen");
     lua_pushcfunction(L, uw_run);           lua_setfield(L, -2, "run");
@@ -2035,6 +5695,8 @@ static void create_app_metatable(lua_State *L) {
     lua_pushcfunction(L, uw_async_write_file); lua_setfield(L, -2, "async_write_file");
     lua_pushcfunction(L, uw_sync_read_file);   lua_setfield(L, -2, "sync_read_file");
     lua_pushcfunction(L, uw_sync_write_file);  lua_setfield(L, -2, "sync_write_file");
+    lua_pushcfunction(L, uw_configure_io);     lua_setfield(L, -2, "configure_io");
+    lua_pushcfunction(L, uw_io_stats);         lua_setfield(L, -2, "io_stats");
 
     // set __index = methods table
     lua_setfield(L, -2, "__index");
@@ -2096,7 +5758,6 @@ int uw_restart_reregister(lua_State *L) {
         init_timer_system();
 
         if (main_L) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
             lua_getglobal(main_L, "on_restart_register");
             if (lua_isfunction(main_L, -1)) {
                 // Create a proper app userdata with the same metatable as uw_create_app
@@ -2120,7 +5781,6 @@ int uw_restart_reregister(lua_State *L) {
 
         // Now listen
         app->listen(port, [port, cb_ref](auto *token) {
-            std::lock_guard<std::mutex> lock(lua_mutex);
 
             if (token) {
                 listen_socket = token;
@@ -2151,12 +5811,99 @@ int uw_restart_reregister(lua_State *L) {
 }
 
 
+extern "C" int luaopen_uwebsockets(lua_State *L);
+
+// Body of one cluster worker thread. Everything the worker touches (app, main_L,
+// callbacks, timers, the uWS::Loop itself) is thread_local, so it is a fully
+// independent server that only shares the listening port with its siblings.
+static void run_cluster_worker(int worker_id, int worker_count, const std::string& bootstrap) {
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        std::cerr << "[cluster] Worker " << worker_id << ": failed to create Lua state" << std::endl;
+        return;
+    }
+    luaL_openlibs(L);
+
+    // Let require("uwebsockets") inside the bootstrap resolve to this already loaded module
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, luaopen_uwebsockets);
+    lua_setfield(L, -2, "uwebsockets");
+    lua_pop(L, 2);
+
+    std::error_code ec;
+    int status = fs::is_regular_file(bootstrap, ec)
+        ? luaL_loadfile(L, bootstrap.c_str())
+        : luaL_loadbuffer(L, bootstrap.data(), bootstrap.size(), "=cluster_bootstrap");
+
+    if (status != LUA_OK) {
+        std::cerr << "[cluster] Worker " << worker_id << ": failed to load bootstrap: "
+                  << lua_tostring(L, -1) << std::endl;
+        lua_close(L);
+        return;
+    }
+
+    // The bootstrap chunk receives (worker_id, worker_count) as its varargs
+    lua_pushinteger(L, worker_id);
+    lua_pushinteger(L, worker_count);
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        std::cerr << "[cluster] Worker " << worker_id << ": bootstrap error: "
+                  << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+    } else if (app) {
+        // The bootstrap registered routes and called listen() but left running the loop to us
+        uw_run(L);
+    }
+
+    lua_close(L);
+}
+
+// Lua callable function to start a multi-threaded server
+// Expected usage: uwebsockets.create_cluster(n, bootstrap)
+// `bootstrap` is either a path to a Lua file or a Lua source chunk. It is executed in
+// every worker with its own lua_State, so route registrations, middleware and
+// app:listen(port) are replayed per worker. All workers bind the same port; uSockets
+// sets SO_REUSEPORT on listen sockets so the kernel balances connections across them.
+// Blocks until every worker's loop has exited.
+int uw_create_cluster(lua_State *L) {
+    int worker_count = static_cast<int>(luaL_optinteger(L, 1, 0));
+    size_t len;
+    const char *bootstrap = luaL_checklstring(L, 2, &len);
+
+    if (worker_count <= 0) {
+        worker_count = static_cast<int>(std::thread::hardware_concurrency());
+        if (worker_count <= 0) worker_count = 1;
+    }
+
+    std::string bootstrap_str(bootstrap, len);
+    std::vector<std::thread> workers;
+    workers.reserve(worker_count);
+
+    try {
+        for (int i = 0; i < worker_count; ++i) {
+            workers.emplace_back(run_cluster_worker, i + 1, worker_count, bootstrap_str);
+        }
+    } catch (const std::system_error& e) {
+        std::cerr << "[cluster] Failed to start worker thread: " << e.what() << std::endl;
+    }
+
+    std::cout << "[cluster] Started " << workers.size() << " worker(s)" << std::endl;
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    lua_pushboolean(L, workers.size() == static_cast<size_t>(worker_count));
+    return 1;
+}
+
 extern "C" int luaopen_uwebsockets(lua_State *L) {
     create_metatables(L);     // req, res, websocket
     create_app_metatable(L);  // app
 
     luaL_Reg functions[] = {
         {"create_app", uw_create_app},
+        {"create_cluster", uw_create_cluster},
         {nullptr, nullptr}
     };
 